@@ -21,6 +21,9 @@ TheApp* CreateApp() { return new AnimationApp(); }
 // bin count
 #define BINS 8
 
+// per frame, in milliseconds: time for moving badly placed subtrees after refitting; 0: refit only
+#define REPAIR_BUDGET 1.0f
+
 // forward declarations
 void Subdivide( uint nodeIdx );
 void UpdateNodeBounds( uint nodeIdx );
@@ -30,6 +33,9 @@ Tri tri[N], original[N];
 uint triIdx[N];
 BVHNode* bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * N * 2, 64 );
 uint rootNodeIdx = 0, nodesUsed = 2;
+BVHNode* bvhNodeTemp = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * N * 2, 64 );
+uint parentIdx[N * 2], candidate[N * 2], dfsStack[N * 2];
+float inefficiency[N * 2];
 
 // functions
 
@@ -129,6 +135,121 @@ void RefitBVH()
 	printf( "BVH refitted in %.2fms  ", t.elapsed() * 1000 );
 }
 
+float NodeArea( const BVHNode& node )
+{
+	float3 e = node.aabbMax - node.aabbMin; // node extent
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+float Inefficiency( uint nodeIdx )
+{
+	// box area of an interior node, relative to the box areas of its children
+	BVHNode& node = bvhNode[nodeIdx];
+	float childArea = NodeArea( bvhNode[node.leftFirst] ) + NodeArea( bvhNode[node.leftFirst + 1] );
+	return NodeArea( node ) / max( childArea, 1e-20f );
+}
+
+void RefitPath( uint nodeIdx )
+{
+	// update the bounds of a node and its ancestors
+	while (1)
+	{
+		BVHNode& node = bvhNode[nodeIdx];
+		node.aabbMin = fminf( bvhNode[node.leftFirst].aabbMin, bvhNode[node.leftFirst + 1].aabbMin );
+		node.aabbMax = fmaxf( bvhNode[node.leftFirst].aabbMax, bvhNode[node.leftFirst + 1].aabbMax );
+		if (nodeIdx == rootNodeIdx) break;
+		nodeIdx = parentIdx[nodeIdx];
+	}
+}
+
+uint Reinsert( uint nodeIdx )
+{
+	// remove the node: its sibling takes the place of the parent, freeing a node pair
+	uint parent = parentIdx[nodeIdx], pair = bvhNode[parent].leftFirst;
+	BVHNode node = bvhNode[nodeIdx], sibling = bvhNode[nodeIdx == pair ? pair + 1 : pair];
+	bvhNode[parent] = sibling;
+	if (!sibling.isLeaf()) parentIdx[sibling.leftFirst] = parentIdx[sibling.leftFirst + 1] = parent;
+	if (parent != rootNodeIdx) RefitPath( parentIdx[parent] );
+	// branch and bound search for the position where the node adds the least area:
+	// the area of the new parent plus the growth of all its ancestors
+	struct Candidate { float inducedCost; uint nodeIdx; } queue[256];
+	auto Greater = []( const Candidate& a, const Candidate& b ) { return a.inducedCost > b.inducedCost; };
+	uint queueSize = 1, best = rootNodeIdx;
+	float bestCost = 1e30f, nodeArea = NodeArea( node );
+	queue[0].inducedCost = 0, queue[0].nodeIdx = rootNodeIdx;
+	while (queueSize > 0)
+	{
+		pop_heap( queue, queue + queueSize, Greater );
+		Candidate c = queue[--queueSize];
+		if (c.inducedCost + nodeArea >= bestCost) break;
+		BVHNode& target = bvhNode[c.nodeIdx];
+		float3 e = fmaxf( target.aabbMax, node.aabbMax ) - fminf( target.aabbMin, node.aabbMin );
+		float cost = c.inducedCost + e.x * e.y + e.y * e.z + e.z * e.x;
+		if (cost < bestCost) bestCost = cost, best = c.nodeIdx;
+		float childInducedCost = cost - NodeArea( target );
+		if (target.isLeaf() || childInducedCost + nodeArea >= bestCost || queueSize > 254) continue;
+		for (uint i = 0; i < 2; i++)
+			queue[queueSize].inducedCost = childInducedCost, queue[queueSize++].nodeIdx = target.leftFirst + i,
+			push_heap( queue, queue + queueSize, Greater );
+	}
+	// insert: the target becomes the parent of its old contents and the node
+	BVHNode target = bvhNode[best];
+	bvhNode[pair] = target, bvhNode[pair + 1] = node;
+	parentIdx[pair] = parentIdx[pair + 1] = best;
+	if (!target.isLeaf()) parentIdx[target.leftFirst] = parentIdx[target.leftFirst + 1] = pair;
+	if (!node.isLeaf()) parentIdx[node.leftFirst] = parentIdx[node.leftFirst + 1] = pair + 1;
+	bvhNode[best].leftFirst = pair, bvhNode[best].triCount = 0;
+	RefitPath( best );
+	return best;
+}
+
+void RepairBVH( float budget )
+{
+	// refitting keeps the topology, which gets worse as the mesh deforms. here we take
+	// out subtrees below nodes with a large box compared to their children, and
+	// reinsert them where they add the least area, until budget (in ms) is spent. this
+	// is BVH::OptimizeReinsertion of bvh.cpp, reduced to this app's binary BVH.
+	Timer t;
+	uint candidates = 0;
+	for (uint i = 0; i < nodesUsed; i++) if (i != 1 && !bvhNode[i].isLeaf())
+	{
+		BVHNode& node = bvhNode[i];
+		parentIdx[node.leftFirst] = parentIdx[node.leftFirst + 1] = i;
+		inefficiency[i] = Inefficiency( i );
+		if (i != rootNodeIdx) candidate[candidates++] = i;
+	}
+	auto Worse = []( uint a, uint b ) { return inefficiency[a] != inefficiency[b] ? inefficiency[a] > inefficiency[b] : a < b; };
+	uint worst = min( candidates, max( 1u, candidates / 10 ) ), moved = 0;
+	if (worst == 0) return;
+	nth_element( candidate, candidate + worst - 1, candidate + candidates, Worse );
+	sort( candidate, candidate + worst, Worse );
+	float threshold = inefficiency[candidate[worst - 1]];
+	for (uint i = 0; i < worst && t.elapsed() * 1000 < budget; i++)
+	{
+		// an earlier move may have stored another subtree here, or changed its bounds
+		uint nodeIdx = candidate[i];
+		if (bvhNode[nodeIdx].isLeaf() || Inefficiency( nodeIdx ) < threshold) continue;
+		uint left = bvhNode[nodeIdx].leftFirst;
+		if (Reinsert( NodeArea( bvhNode[left] ) < NodeArea( bvhNode[left + 1] ) ? left : left + 1 ) != nodeIdx) moved++;
+	}
+	if (moved == 0) return;
+	// RefitBVH expects children after their parents: store the nodes depth-first
+	uint stackPtr = 1, newNodesUsed = 2;
+	bvhNodeTemp[0] = bvhNode[0], dfsStack[0] = 0;
+	while (stackPtr > 0)
+	{
+		BVHNode& node = bvhNodeTemp[dfsStack[--stackPtr]];
+		if (node.isLeaf()) continue;
+		bvhNodeTemp[newNodesUsed] = bvhNode[node.leftFirst];
+		bvhNodeTemp[newNodesUsed + 1] = bvhNode[node.leftFirst + 1];
+		node.leftFirst = newNodesUsed;
+		dfsStack[stackPtr++] = newNodesUsed + 1, dfsStack[stackPtr++] = newNodesUsed;
+		newNodesUsed += 2;
+	}
+	swap( bvhNode, bvhNodeTemp );
+	printf( "BVH repaired in %.2fms (%i moves)  ", t.elapsed() * 1000, moved );
+}
+
 void BuildBVH()
 {
 	// reset node pool
@@ -296,6 +417,7 @@ void AnimationApp::Tick( float deltaTime )
 	Animate();
 	// BuildBVH();
 	RefitBVH();
+	if (REPAIR_BUDGET > 0) RepairBVH( REPAIR_BUDGET );
 	// draw the scene
 	float3 p0( -1, 1, 2 ), p1( 1, 1, 2 ), p2( -1, -1, 2 );
 	Timer t;
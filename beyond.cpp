@@ -186,6 +186,9 @@ void BeyondApp::HandleKeys( float dt )
 void BeyondApp::Init()
 {
 	mesh = new Mesh( "assets/dragon.obj", "assets/bricks.png" );
+	mesh->bvh->ReorderTriangles(); // the GPU traversal expects triangles in leaf order
+	mesh->bvh->PrecomputeTriangles(); // the GPU intersects the per-triangle transforms
+	printf( "compacting the BLAS saved %.1fKB.\n", mesh->bvh->Compact() / 1024.0f );
 	// load HDR sky
 	skyPixels = stbi_loadf( "assets/sky_19.hdr", &skyWidth, &skyHeight, &skyBpp, 0 );
 	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
@@ -198,20 +201,24 @@ void BeyondApp::Init()
 		bvhInstance[i] = BVHInstance( mesh->bvh, i );
 	tlas = TLAS( bvhInstance, boidCount );
 	// prepare OpenCL
-	tracer = new Kernel( "cl/raytracer.cl", "render" );
+	tracer = new Kernel( "cl/raytracer.cl", "render", "-D USE_TRIACCEL -D USE_LEAF_ORDER" ); // matches the uploaded data
 	target = new Buffer( GetRenderTarget()->ID, 0, Buffer::TARGET );
 	screen = 0;
 	skyData = new Buffer( skyWidth * skyHeight * 3 * sizeof( float ), skyPixels );
 	skyData->CopyToDevice();
-	triData = new Buffer( mesh->triCount * sizeof( Tri ), mesh->tri );
-	triExData = new Buffer( mesh->triCount * sizeof( TriEx ), mesh->triEx );
+	// leaf order: the triangles, transforms and shading data follow the leaves; see BVH::ReorderTriangles
+	const uint leafTris = mesh->bvh->idxCount;
+	triData = new Buffer( leafTris * sizeof( Tri ), mesh->bvh->leafTri );
+	accelData = new Buffer( leafTris * sizeof( TriAccel ), mesh->bvh->triAccel );
+	triExData = new Buffer( leafTris * sizeof( TriEx ), mesh->bvh->leafTriEx );
 	Surface* tex = mesh->texture;
 	texData = new Buffer( tex->width * tex->height * sizeof( uint ), tex->pixels );
 	instData = new Buffer( boidCount * sizeof( BVHInstance ), bvhInstance );
 	tlasData = new Buffer( (boidCount * 2 + 64) * sizeof( TLASNode ), tlas.tlasNode );
 	bvhData = new Buffer( mesh->bvh->nodesUsed * sizeof( BVHNode ), mesh->bvh->bvhNode );
-	idxData = new Buffer( mesh->triCount * sizeof( uint ), mesh->bvh->triIdx );
+	idxData = new Buffer( leafTris * sizeof( uint ), mesh->bvh->triIdx );
 	triData->CopyToDevice();
+	accelData->CopyToDevice();
 	triExData->CopyToDevice();
 	texData->CopyToDevice();
 	bvhData->CopyToDevice();
@@ -273,7 +280,7 @@ void BeyondApp::Tick( float deltaTime )
 	// render the scene using the GPU & gather profling information
 	tracer->SetArguments(
 		target, skyData,
-		triData, triExData, texData, tlasData, instData, bvhData, idxData,
+		triData, accelData, triExData, texData, tlasData, instData, bvhData, idxData,
 		camPos, p0, p1, p2
 	);
 	static bool inited = false;
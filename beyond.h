@@ -31,6 +31,7 @@ public:
 	Buffer* target;		// buffer encapsulating texture that holds the rendered image
 	Buffer* skyData;	// buffer for the skydome texture
 	Buffer* triData;	// buffer for the mesh Tri data (vertices for intersection)
+	Buffer* accelData;	// buffer for the per-triangle transforms (BVH::triAccel)
 	Buffer* triExData;	// buffer for the mesh TriEx data (vertices for shading)
 	Buffer* texData;	// buffer for the brick texture
 	Buffer* tlasData;	// buffer to store the TLAS
@@ -1,5 +1,6 @@
 #include "precomp.h"
 #include "bvh.h"
+#include <omp.h>
 
 /*
 Performance: 1858ms without kD-tree
@@ -35,196 +36,2346 @@ void IntersectTri( Ray& ray, const Tri& tri, const uint instPrim )
 		ray.hit.v = v, ray.hit.instPrim = instPrim;
 }
 
+void IntersectTri( Ray& ray, const TriAccel& tri, const uint instPrim )
+{
+	// precomputed triangle transform: the plane distance along the ray first, then the
+	// barycentrics of the hit point; one division and five dot products
+	const float t = -(dot( tri.W, ray.O ) + tri.dw) / dot( tri.W, ray.D );
+	if (!(t > 0.0001f && t < ray.hit.t)) return; // also rejects NaN, for parallel rays
+	const float3 I = ray.O + t * ray.D;
+	const float u = dot( tri.U, I ) + tri.du;
+	if (u < 0 || u > 1) return;
+	const float v = dot( tri.V, I ) + tri.dv;
+	if (v < 0 || u + v > 1) return;
+	ray.hit.t = t, ray.hit.u = u,
+	ray.hit.v = v, ray.hit.instPrim = instPrim;
+}
+
 inline float IntersectAABB( const Ray& ray, const float3 bmin, const float3 bmax )
 {
-	// "slab test" ray/AABB intersection
-	float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
-	float tmin = min( tx1, tx2 ), tmax = max( tx1, tx2 );
-	float ty1 = (bmin.y - ray.O.y) * ray.rD.y, ty2 = (bmax.y - ray.O.y) * ray.rD.y;
-	tmin = max( tmin, min( ty1, ty2 ) ), tmax = min( tmax, max( ty1, ty2 ) );
-	float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
-	tmin = max( tmin, min( tz1, tz2 ) ), tmax = min( tmax, max( tz1, tz2 ) );
-	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
+	// "slab test" ray/AABB intersection
+	float tx1 = (bmin.x - ray.O.x) * ray.rD.x, tx2 = (bmax.x - ray.O.x) * ray.rD.x;
+	float tmin = min( tx1, tx2 ), tmax = max( tx1, tx2 );
+	float ty1 = (bmin.y - ray.O.y) * ray.rD.y, ty2 = (bmax.y - ray.O.y) * ray.rD.y;
+	tmin = max( tmin, min( ty1, ty2 ) ), tmax = min( tmax, max( ty1, ty2 ) );
+	float tz1 = (bmin.z - ray.O.z) * ray.rD.z, tz2 = (bmax.z - ray.O.z) * ray.rD.z;
+	tmin = max( tmin, min( tz1, tz2 ) ), tmax = min( tmax, max( tz1, tz2 ) );
+	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
+}
+
+template <int OCTANT> inline bool IntersectAABB( const Ray& ray, const BVHNode& node )
+{
+	// slab test for a ray in a known octant: bit k set means a negative direction on axis k,
+	// so the far plane of that axis is entered first and no min/max per axis is needed
+	const float tx1 = ((OCTANT & 1 ? node.aabbMax.x : node.aabbMin.x) - ray.O.x) * ray.rD.x;
+	const float tx2 = ((OCTANT & 1 ? node.aabbMin.x : node.aabbMax.x) - ray.O.x) * ray.rD.x;
+	const float ty1 = ((OCTANT & 2 ? node.aabbMax.y : node.aabbMin.y) - ray.O.y) * ray.rD.y;
+	const float ty2 = ((OCTANT & 2 ? node.aabbMin.y : node.aabbMax.y) - ray.O.y) * ray.rD.y;
+	const float tz1 = ((OCTANT & 4 ? node.aabbMax.z : node.aabbMin.z) - ray.O.z) * ray.rD.z;
+	const float tz2 = ((OCTANT & 4 ? node.aabbMin.z : node.aabbMax.z) - ray.O.z) * ray.rD.z;
+	const float tmin = max( max( tx1, ty1 ), max( tz1, 0.0f ) ), tmax = min( min( tx2, ty2 ), min( tz2, ray.hit.t ) );
+	return tmin <= tmax;
+}
+
+float IntersectAABB_SSE( const Ray& ray, const __m128& bmin4, const __m128& bmax4 )
+{
+	// "slab test" ray/AABB intersection, using SIMD instructions
+	static __m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
+	__m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmin4, mask4 ), ray.O4 ), ray.rD4 );
+	__m128 t2 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmax4, mask4 ), ray.O4 ), ray.rD4 );
+	__m128 vmax4 = _mm_max_ps( t1, t2 ), vmin4 = _mm_min_ps( t1, t2 );
+	float tmax = min( vmax4.m128_f32[0], min( vmax4.m128_f32[1], vmax4.m128_f32[2] ) );
+	float tmin = max( vmin4.m128_f32[0], max( vmin4.m128_f32[1], vmin4.m128_f32[2] ) );
+	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
+}
+
+// wide BVH helpers
+
+// uniform access to the nodes of binary BVHs and TLASes, for collapsing them to wide nodes
+inline bool IsLeaf( const BVHNode& node ) { return node.isLeaf(); }
+inline bool IsLeaf( const TLASNode& node ) { return node.leftRight == 0; }
+inline uint LeftChild( const BVHNode& node ) { return node.leftFirst; }
+inline uint LeftChild( const TLASNode& node ) { return node.leftRight & 0xffff; }
+inline uint RightChild( const BVHNode& node ) { return node.leftFirst + 1; }
+inline uint RightChild( const TLASNode& node ) { return node.leftRight >> 16; }
+inline uint LeafFirst( const BVHNode& node ) { return node.leftFirst; }
+inline uint LeafFirst( const TLASNode& node ) { return node.BLAS; }
+inline uint LeafCount( const BVHNode& node ) { return node.triCount; }
+inline uint LeafCount( const TLASNode& ) { return 1; }
+template <class N> inline float BoxArea( const N& node )
+{
+	float3 e = node.aabbMax - node.aabbMin; // node extent
+	return e.x * e.y + e.y * e.z + e.z * e.x;
+}
+
+void* ReserveWide( void*& data, size_t& capacity, const size_t bytes )
+{
+	if (bytes > capacity) _aligned_free( data ), data = _aligned_malloc( bytes, 64 ), capacity = bytes;
+	return data;
+}
+
+template <int W, class BinaryNode> uint OpenSlots( const BinaryNode* node, uint nodeIdx, uint slot[W] )
+{
+	// gather up to W subtrees by repeatedly opening the largest interior one
+	uint slots = 1;
+	slot[0] = nodeIdx;
+	while (slots < W)
+	{
+		int best = -1;
+		float bestArea = -1;
+		for (uint i = 0; i < slots; i++) if (!IsLeaf( node[slot[i]] ))
+		{
+			float area = BoxArea( node[slot[i]] );
+			if (area > bestArea) best = i, bestArea = area;
+		}
+		if (best == -1) break;
+		const BinaryNode& opened = node[slot[best]];
+		slot[best] = LeftChild( opened ), slot[slots++] = RightChild( opened );
+	}
+	return slots;
+}
+
+template <int W, class BinaryNode, class WideNode> uint CollapseNode( const BinaryNode* node, uint nodeIdx, WideNode* wideNode, uint& wideNodesUsed )
+{
+	uint slot[W], slots = OpenSlots<W>( node, nodeIdx, slot );
+	const uint wideIdx = wideNodesUsed++;
+	for (uint i = 0; i < W; i++)
+	{
+		WideNode& wide = wideNode[wideIdx];
+		float* bounds = (float*)wide.bounds; // six rows of W floats
+		if (i >= slots)
+		{
+			// empty slot: an inverted box
+			for (int a = 0; a < 3; a++) bounds[a * W + i] = 1e30f, bounds[(a + 3) * W + i] = -1e30f;
+			wide.child[i] = wide.triCount[i] = 0;
+			continue;
+		}
+		const BinaryNode& child = node[slot[i]];
+		for (int a = 0; a < 3; a++)
+			bounds[a * W + i] = child.aabbMin.cell[a],
+			bounds[(a + 3) * W + i] = child.aabbMax.cell[a];
+		wide.triCount[i] = IsLeaf( child ) ? LeafCount( child ) : 0;
+		wide.child[i] = IsLeaf( child ) ? LeafFirst( child ) : CollapseNode<W>( node, slot[i], wideNode, wideNodesUsed );
+	}
+	return wideIdx;
+}
+
+template <class BinaryNode> bool CollapseNodeCompressed( const BinaryNode* node, uint nodeIdx, uint wideIdx, BVH8CNode* wideNode, uint& wideNodesUsed, const uint* leafPrim, uint* prim, uint& primsUsed )
+{
+	// as CollapseNode<8>, but the interior children of a node are stored consecutively, and
+	// the primitives of its leaf children are copied to prim, so that 16-bit offsets suffice.
+	// returns false if a leaf has more primitives than a count byte holds.
+	uint slot[8], slots = OpenSlots<8>( node, nodeIdx, slot );
+	BVH8CNode& wide = wideNode[wideIdx];
+	// quantization grid: the union of the child boxes, in 255 steps of a power of two per axis
+	aabb box;
+	for (uint i = 0; i < slots; i++) box.grow( node[slot[i]].aabbMin ), box.grow( node[slot[i]].aabbMax );
+	wide.origin = box.bmin;
+	float scale[3];
+	for (int a = 0; a < 3; a++)
+	{
+		int e;
+		frexpf( (box.bmax.cell[a] - box.bmin.cell[a]) / 255, &e );
+		e = max( -126, min( 127, e ) );
+		if (e < 127 && box.bmin.cell[a] + 255 * ldexpf( 1, e ) < box.bmax.cell[a]) e++; // rounding
+		wide.exponent[a] = (uchar)(e + 127), scale[a] = ldexpf( 1, e );
+	}
+	wide.childBase = wideNodesUsed, wide.primBase = primsUsed;
+	uint interior = 0;
+	for (uint i = 0; i < 8; i++)
+	{
+		if (i >= slots)
+		{
+			// empty slot: an inverted box
+			for (int a = 0; a < 3; a++) wide.bounds[a][i] = 255, wide.bounds[a + 3][i] = 0;
+			wide.offset[i] = wide.count[i] = 0;
+			continue;
+		}
+		const BinaryNode& child = node[slot[i]];
+		for (int a = 0; a < 3; a++)
+		{
+			// round outwards; decoding computes origin + q * scale, which is exact up to the add
+			const float o = wide.origin.cell[a], bmin = child.aabbMin.cell[a], bmax = child.aabbMax.cell[a];
+			int lo = max( 0, min( 255, (int)floorf( (bmin - o) / scale[a] ) ) );
+			int hi = max( 0, min( 255, (int)ceilf( (bmax - o) / scale[a] ) ) );
+			while (lo > 0 && o + lo * scale[a] > bmin) lo--;
+			while (hi < 255 && o + hi * scale[a] < bmax) hi++;
+			wide.bounds[a][i] = (uchar)lo, wide.bounds[a + 3][i] = (uchar)hi;
+		}
+		if (IsLeaf( child ))
+		{
+			const uint first = LeafFirst( child ), count = LeafCount( child );
+			if (count > 255) return false;
+			wide.offset[i] = (ushort)(primsUsed - wide.primBase), wide.count[i] = (uchar)count;
+			for (uint j = 0; j < count; j++) prim[primsUsed++] = leafPrim ? leafPrim[first + j] : first + j;
+		}
+		else wide.offset[i] = (ushort)interior++, wide.count[i] = 0;
+	}
+	// allocate the interior children as one block, then fill them
+	wideNodesUsed += interior;
+	for (uint i = 0, j = 0; i < slots; i++) if (!IsLeaf( node[slot[i]] ))
+		if (!CollapseNodeCompressed( node, slot[i], wide.childBase + j++, wideNode, wideNodesUsed, leafPrim, prim, primsUsed )) return false;
+	return true;
+}
+
+// node relayout
+
+inline void SetChildren( BVHNode& node, uint first ) { node.leftFirst = first; }
+inline void SetChildren( TLASNode& node, uint first ) { node.leftRight = first + ((first + 1) << 16); }
+
+template <class Node> uint PairHeight( const Node* node, uint idx )
+{
+	// height of the subtree of idx, counted in sibling pairs
+	if (IsLeaf( node[idx] )) return 0;
+	return 1 + max( PairHeight( node, LeftChild( node[idx] ) ), PairHeight( node, RightChild( node[idx] ) ) );
+}
+
+template <class Node> void GatherPairs( const Node* node, uint idx, uint depth, uint* list, uint& count )
+{
+	// the interior nodes depth pairs below idx; without a list, this just counts them
+	if (IsLeaf( node[idx] )) return;
+	if (depth == 0) { if (list) list[count] = idx; count++; return; }
+	GatherPairs( node, LeftChild( node[idx] ), depth - 1, list, count );
+	GatherPairs( node, RightChild( node[idx] ), depth - 1, list, count );
+}
+
+template <class Node> void VanEmdeBoasOrder( const Node* node, uint idx, uint height, uint* order, uint& count )
+{
+	// the top half of the pair levels first, then each bottom tree, recursively; a subtree
+	// of any size then occupies a small number of contiguous blocks
+	if (height == 0 || IsLeaf( node[idx] )) return;
+	if (height == 1) { order[count++] = idx; return; }
+	const uint top = height / 2;
+	VanEmdeBoasOrder( node, idx, top, order, count );
+	uint bottomCount = 0;
+	GatherPairs( node, idx, top, (uint*)0, bottomCount );
+	uint* bottom = new uint[bottomCount];
+	bottomCount = 0;
+	GatherPairs( node, idx, top, bottom, bottomCount );
+	for (uint i = 0; i < bottomCount; i++) VanEmdeBoasOrder( node, bottom[i], height - top, order, count );
+	delete[] bottom;
+}
+
+template <class Node> uint CopyNodesInOrder( const Node* node, Node* newNode, uint nodesUsed, NodeLayout layout )
+{
+	// list the interior nodes in the order in which their child pairs will be stored
+	uint* order = new uint[nodesUsed], count = 0;
+	if (layout == LAYOUT_VEB) VanEmdeBoasOrder( node, 0, PairHeight( node, 0 ), order, count );
+	else
+	{
+		// breadth-first for the top levels, if requested
+		uint* level = new uint[nodesUsed], levelSize = IsLeaf( node[0] ) ? 0 : 1;
+		level[0] = 0;
+		for (uint depth = 0; layout == LAYOUT_BFS_TOP && depth < LAYOUT_BFS_LEVELS && levelSize > 0; depth++)
+		{
+			uint nextSize = 0;
+			for (uint i = 0; i < levelSize; i++)
+			{
+				const Node& n = node[order[count++] = level[i]];
+				if (!IsLeaf( node[LeftChild( n )] )) level[levelSize + nextSize++] = LeftChild( n );
+				if (!IsLeaf( node[RightChild( n )] )) level[levelSize + nextSize++] = RightChild( n );
+			}
+			memmove( level, level + levelSize, nextSize * sizeof( uint ) ), levelSize = nextSize;
+		}
+		// depth-first below that: each pair is followed by the subtree of its first node
+		uint* stack = new uint[nodesUsed];
+		for (uint i = 0; i < levelSize; i++)
+		{
+			uint stackPtr = 1;
+			stack[0] = level[i];
+			while (stackPtr > 0)
+			{
+				const Node& n = node[order[count++] = stack[--stackPtr]];
+				if (!IsLeaf( node[RightChild( n )] )) stack[stackPtr++] = RightChild( n );
+				if (!IsLeaf( node[LeftChild( n )] )) stack[stackPtr++] = LeftChild( n );
+			}
+		}
+		delete[] stack;
+		delete[] level;
+	}
+	// store the pairs; the root stays at index 0, and 1 stays unused
+	uint* newIdx = new uint[nodesUsed];
+	newNode[0] = node[0], newNode[1] = node[1], newIdx[0] = 0;
+	for (uint i = 0; i < count; i++)
+	{
+		const Node& n = node[order[i]];
+		newNode[2 + 2 * i] = node[LeftChild( n )], newIdx[LeftChild( n )] = 2 + 2 * i;
+		newNode[3 + 2 * i] = node[RightChild( n )], newIdx[RightChild( n )] = 3 + 2 * i;
+	}
+	for (uint i = 0; i < count; i++) SetChildren( newNode[newIdx[order[i]]], 2 + 2 * i );
+	delete[] newIdx;
+	delete[] order;
+	return 2 + 2 * count;
+}
+
+struct CacheSim
+{
+	// set-associative cache of 64-byte lines with LRU replacement, for comparing node layouts
+	CacheSim( uint size, uint associativity = 8 ) : ways( associativity )
+	{
+		sets = max( 1u, size / 64 / ways );
+		line = new uint64_t[sets * ways];
+		memset( line, 0, sets * ways * sizeof( uint64_t ) );
+	}
+	~CacheSim() { delete[] line; }
+	void Touch( const void* address )
+	{
+		const uint64_t tag = ((uint64_t)address >> 6) + 1; // 0 marks an empty way
+		uint64_t* set = line + (tag % sets) * ways;
+		uint way = 0;
+		while (way < ways - 1 && set[way] != tag) way++;
+		if (set[way] != tag) misses++;
+		// move to the front, evicting the least recently used line on a miss
+		for (; way > 0; way--) set[way] = set[way - 1];
+		set[0] = tag;
+	}
+	uint64_t* line;
+	uint sets, ways, misses = 0;
+};
+
+struct CompressTable
+{
+	// for each 8-bit mask: the indices of the set bits, for _mm256_permutevar8x32
+	__declspec(align(32)) int perm[256][8];
+	// for each 4-bit mask: the same for 32-bit lanes, as bytes for _mm_shuffle_epi8
+	__declspec(align(16)) uchar shuffle[16][16];
+	CompressTable()
+	{
+		for (int mask = 0; mask < 256; mask++) for (int n = 0, i = 0; i < 8; i++)
+		{
+			perm[mask][i] = 0;
+			if (mask & (1 << i)) perm[mask][n++] = i;
+		}
+		for (int mask = 0; mask < 16; mask++) for (int i = 0; i < 4; i++)
+			for (int j = 0; j < 4; j++) shuffle[mask][i * 4 + j] = (uchar)(perm[mask][i] * 4 + j);
+	}
+} compressTable;
+
+// slab test against all children of a wide node. per axis, the sign of the ray direction
+// selects the near bound, so empty child slots never hit. the children that were hit are
+// compressed to the front of the child, count and dist arrays with one shuffle per array;
+// returns their number.
+inline uint IntersectChildren( const Ray& ray, const int sign[3], const BVH4Node& node, uint* child, uint* count, float* dist )
+{
+	const __m128 Ox4 = _mm_set1_ps( ray.O.x ), Oy4 = _mm_set1_ps( ray.O.y ), Oz4 = _mm_set1_ps( ray.O.z );
+	const __m128 rDx4 = _mm_set1_ps( ray.rD.x ), rDy4 = _mm_set1_ps( ray.rD.y ), rDz4 = _mm_set1_ps( ray.rD.z );
+	const __m128 tx1 = _mm_mul_ps( _mm_sub_ps( node.bounds[sign[0]], Ox4 ), rDx4 );
+	const __m128 tx2 = _mm_mul_ps( _mm_sub_ps( node.bounds[3 - sign[0]], Ox4 ), rDx4 );
+	const __m128 ty1 = _mm_mul_ps( _mm_sub_ps( node.bounds[1 + sign[1]], Oy4 ), rDy4 );
+	const __m128 ty2 = _mm_mul_ps( _mm_sub_ps( node.bounds[4 - sign[1]], Oy4 ), rDy4 );
+	const __m128 tz1 = _mm_mul_ps( _mm_sub_ps( node.bounds[2 + sign[2]], Oz4 ), rDz4 );
+	const __m128 tz2 = _mm_mul_ps( _mm_sub_ps( node.bounds[5 - sign[2]], Oz4 ), rDz4 );
+	const __m128 tmin4 = _mm_max_ps( _mm_max_ps( tx1, ty1 ), _mm_max_ps( tz1, _mm_setzero_ps() ) );
+	const __m128 tmax4 = _mm_min_ps( _mm_min_ps( tx2, ty2 ), _mm_min_ps( tz2, _mm_set1_ps( ray.hit.t ) ) );
+	const int mask = _mm_movemask_ps( _mm_cmple_ps( tmin4, tmax4 ) );
+	const __m128i shuffle4 = _mm_load_si128( (const __m128i*)compressTable.shuffle[mask] );
+	_mm_storeu_ps( dist, _mm_castsi128_ps( _mm_shuffle_epi8( _mm_castps_si128( tmin4 ), shuffle4 ) ) );
+	_mm_storeu_si128( (__m128i*)child, _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)node.child ), shuffle4 ) );
+	_mm_storeu_si128( (__m128i*)count, _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i*)node.triCount ), shuffle4 ) );
+	return _mm_popcnt_u32( mask );
+}
+
+inline uint IntersectChildren( const Ray& ray, const int sign[3], const BVH8Node& node, uint* child, uint* count, float* dist )
+{
+	// AVX2 version of the above; the hits are compressed with a single permute
+	const __m256 Ox8 = _mm256_set1_ps( ray.O.x ), Oy8 = _mm256_set1_ps( ray.O.y ), Oz8 = _mm256_set1_ps( ray.O.z );
+	const __m256 rDx8 = _mm256_set1_ps( ray.rD.x ), rDy8 = _mm256_set1_ps( ray.rD.y ), rDz8 = _mm256_set1_ps( ray.rD.z );
+	const __m256 tx1 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[sign[0]], Ox8 ), rDx8 );
+	const __m256 tx2 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[3 - sign[0]], Ox8 ), rDx8 );
+	const __m256 ty1 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[1 + sign[1]], Oy8 ), rDy8 );
+	const __m256 ty2 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[4 - sign[1]], Oy8 ), rDy8 );
+	const __m256 tz1 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[2 + sign[2]], Oz8 ), rDz8 );
+	const __m256 tz2 = _mm256_mul_ps( _mm256_sub_ps( node.bounds[5 - sign[2]], Oz8 ), rDz8 );
+	const __m256 tmin8 = _mm256_max_ps( _mm256_max_ps( tx1, ty1 ), _mm256_max_ps( tz1, _mm256_setzero_ps() ) );
+	const __m256 tmax8 = _mm256_min_ps( _mm256_min_ps( tx2, ty2 ), _mm256_min_ps( tz2, _mm256_set1_ps( ray.hit.t ) ) );
+	const int mask = _mm256_movemask_ps( _mm256_cmp_ps( tmin8, tmax8, _CMP_LE_OQ ) );
+	const __m256i perm8 = _mm256_load_si256( (const __m256i*)compressTable.perm[mask] );
+	_mm256_storeu_ps( dist, _mm256_permutevar8x32_ps( tmin8, perm8 ) );
+	_mm256_storeu_si256( (__m256i*)child, _mm256_permutevar8x32_epi32( _mm256_loadu_si256( (const __m256i*)node.child ), perm8 ) );
+	_mm256_storeu_si256( (__m256i*)count, _mm256_permutevar8x32_epi32( _mm256_loadu_si256( (const __m256i*)node.triCount ), perm8 ) );
+	return _mm_popcnt_u32( mask );
+}
+
+inline uint IntersectChildren( const Ray& ray, const int sign[3], const BVH8CNode& node, uint* child, uint* count, float* dist )
+{
+	// compressed nodes: the slab distance of a quantized plane is q * (scale * rD) + (origin - O) * rD,
+	// so decoding costs no more than the subtraction it replaces
+	union { uint bits[3]; float scale[3]; };
+	bits[0] = node.exponent[0] << 23, bits[1] = node.exponent[1] << 23, bits[2] = node.exponent[2] << 23;
+	const __m256 ax8 = _mm256_set1_ps( scale[0] * ray.rD.x ), bx8 = _mm256_set1_ps( (node.origin.x - ray.O.x) * ray.rD.x );
+	const __m256 ay8 = _mm256_set1_ps( scale[1] * ray.rD.y ), by8 = _mm256_set1_ps( (node.origin.y - ray.O.y) * ray.rD.y );
+	const __m256 az8 = _mm256_set1_ps( scale[2] * ray.rD.z ), bz8 = _mm256_set1_ps( (node.origin.z - ray.O.z) * ray.rD.z );
+	#define PLANES8(row) _mm256_cvtepi32_ps( _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)node.bounds[row] ) ) )
+	const __m256 tx1 = _mm256_add_ps( _mm256_mul_ps( PLANES8( sign[0] ), ax8 ), bx8 );
+	const __m256 tx2 = _mm256_add_ps( _mm256_mul_ps( PLANES8( 3 - sign[0] ), ax8 ), bx8 );
+	const __m256 ty1 = _mm256_add_ps( _mm256_mul_ps( PLANES8( 1 + sign[1] ), ay8 ), by8 );
+	const __m256 ty2 = _mm256_add_ps( _mm256_mul_ps( PLANES8( 4 - sign[1] ), ay8 ), by8 );
+	const __m256 tz1 = _mm256_add_ps( _mm256_mul_ps( PLANES8( 2 + sign[2] ), az8 ), bz8 );
+	const __m256 tz2 = _mm256_add_ps( _mm256_mul_ps( PLANES8( 5 - sign[2] ), az8 ), bz8 );
+	#undef PLANES8
+	const __m256 tmin8 = _mm256_max_ps( _mm256_max_ps( tx1, ty1 ), _mm256_max_ps( tz1, _mm256_setzero_ps() ) );
+	const __m256 tmax8 = _mm256_min_ps( _mm256_min_ps( tx2, ty2 ), _mm256_min_ps( tz2, _mm256_set1_ps( ray.hit.t ) ) );
+	const int mask = _mm256_movemask_ps( _mm256_cmp_ps( tmin8, tmax8, _CMP_LE_OQ ) );
+	// child index: base plus offset; the base depends on the child type
+	const __m256i count8 = _mm256_cvtepu8_epi32( _mm_loadl_epi64( (const __m128i*)node.count ) );
+	const __m256i leaf8 = _mm256_cmpgt_epi32( count8, _mm256_setzero_si256() );
+	const __m256i base8 = _mm256_blendv_epi8( _mm256_set1_epi32( node.childBase ), _mm256_set1_epi32( node.primBase ), leaf8 );
+	const __m256i child8 = _mm256_add_epi32( base8, _mm256_cvtepu16_epi32( _mm_loadu_si128( (const __m128i*)node.offset ) ) );
+	const __m256i perm8 = _mm256_load_si256( (const __m256i*)compressTable.perm[mask] );
+	_mm256_storeu_ps( dist, _mm256_permutevar8x32_ps( tmin8, perm8 ) );
+	_mm256_storeu_si256( (__m256i*)child, _mm256_permutevar8x32_epi32( child8, perm8 ) );
+	_mm256_storeu_si256( (__m256i*)count, _mm256_permutevar8x32_epi32( count8, perm8 ) );
+	return _mm_popcnt_u32( mask );
+}
+
+template <int W, class WideNode, class LeafFunc> void IntersectWide( Ray& ray, const WideNode* wideNode, LeafFunc intersectLeaf )
+{
+	// leaf children are intersected right away; interior children are sorted and
+	// visited nearest first. stacked nodes beyond the nearest hit are skipped.
+	const int sign[3] = { ray.rD.x < 0 ? 3 : 0, ray.rD.y < 0 ? 3 : 0, ray.rD.z < 0 ? 3 : 0 };
+	struct { uint nodeIdx; float dist; } stack[64 * (W - 1)];
+	uint nodeIdx = 0, stackPtr = 0;
+	while (1)
+	{
+		uint child[W], count[W], interior = 0, interiorNode[W];
+		float dist[W], interiorDist[W];
+		const uint hits = IntersectChildren( ray, sign, wideNode[nodeIdx], child, count, dist );
+		for (uint i = 0; i < hits; i++)
+		{
+			if (count[i]) { intersectLeaf( child[i], count[i] ); continue; }
+			// insertion sort, farthest first
+			uint k = interior++;
+			for (; k > 0 && interiorDist[k - 1] < dist[i]; k--)
+				interiorDist[k] = interiorDist[k - 1], interiorNode[k] = interiorNode[k - 1];
+			interiorDist[k] = dist[i], interiorNode[k] = child[i];
+		}
+		if (interior > 0)
+		{
+			// continue with the nearest child; push the others
+			for (uint i = 0; i < interior - 1; i++)
+				stack[stackPtr].nodeIdx = interiorNode[i], stack[stackPtr++].dist = interiorDist[i];
+			nodeIdx = interiorNode[interior - 1];
+			continue;
+		}
+		// pop the nearest node that is still closer than the nearest hit
+		while (stackPtr > 0 && stack[stackPtr - 1].dist >= ray.hit.t) stackPtr--;
+		if (stackPtr == 0) break;
+		nodeIdx = stack[--stackPtr].nodeIdx;
+	}
+}
+
+// ray packet helpers
+
+inline __m128 LaneMask4( const uint bits )
+{
+	// expand four lane bits to a full SSE lane mask
+	const __m128i bit4 = _mm_setr_epi32( 1, 2, 4, 8 );
+	return _mm_castsi128_ps( _mm_cmpeq_epi32( _mm_and_si128( _mm_set1_epi32( bits ), bit4 ), bit4 ) );
+}
+
+template <int N> inline float MaxT( const RayPacket<N>& packet, const uint laneMask )
+{
+	// the farthest intersection of the rays in laneMask
+	__m128 tmax4 = _mm_setzero_ps();
+	for (int g = 0; g < N / 4; g++) tmax4 = _mm_max_ps( tmax4, _mm_and_ps( packet.t4[g], LaneMask4( (laneMask >> (4 * g)) & 15 ) ) );
+	tmax4 = _mm_max_ps( tmax4, _mm_shuffle_ps( tmax4, tmax4, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	tmax4 = _mm_max_ps( tmax4, _mm_shuffle_ps( tmax4, tmax4, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	return tmax4.m128_f32[0];
+}
+
+struct PacketBounds
+{
+	// intervals that contain the origins and reciprocal directions of all rays in a packet;
+	// x, y and z in the first three lanes
+	__m128 Omin, Omax, rDmin, rDmax;
+	__m128 negative; // axes along which all rays point in the negative direction
+	bool valid; // false if the rays do not share their direction signs; culling is then skipped
+};
+
+template <int N> PacketBounds BoundPacket( const RayPacket<N>& packet )
+{
+	PacketBounds b;
+	float3 Omin = 1e30f, Omax = -1e30f, rDmin = 1e30f, rDmax = -1e30f;
+	for (int i = 0; i < N; i++)
+	{
+		const float3 O( packet.O[0][i], packet.O[1][i], packet.O[2][i] );
+		const float3 rD( packet.rD[0][i], packet.rD[1][i], packet.rD[2][i] );
+		Omin = fminf( Omin, O ), Omax = fmaxf( Omax, O ), rDmin = fminf( rDmin, rD ), rDmax = fmaxf( rDmax, rD );
+	}
+	b.valid = true;
+	for (int a = 0; a < 3; a++)
+		if (rDmin.cell[a] * rDmax.cell[a] <= 0 || fabs( rDmin.cell[a] ) >= 1e30f || fabs( rDmax.cell[a] ) >= 1e30f) b.valid = false;
+	b.Omin = _mm_setr_ps( Omin.x, Omin.y, Omin.z, 0 ), b.Omax = _mm_setr_ps( Omax.x, Omax.y, Omax.z, 0 );
+	b.rDmin = _mm_setr_ps( rDmin.x, rDmin.y, rDmin.z, 0 ), b.rDmax = _mm_setr_ps( rDmax.x, rDmax.y, rDmax.z, 0 );
+	b.negative = _mm_cmplt_ps( b.rDmax, _mm_setzero_ps() );
+	return b;
+}
+
+inline bool PacketMissesBox( const PacketBounds& b, const __m128 bmin4, const __m128 bmax4, const float tmax )
+{
+	// interval arithmetic: per axis, the entry and exit distances of all rays lie in [lower, upper].
+	// if the latest entry follows the earliest exit, no ray in the packet hits the box.
+	const __m128 nearPlane = _mm_blendv_ps( bmin4, bmax4, b.negative ), farPlane = _mm_blendv_ps( bmax4, bmin4, b.negative );
+	const __m128 n1 = _mm_sub_ps( nearPlane, b.Omax ), n2 = _mm_sub_ps( nearPlane, b.Omin );
+	const __m128 f1 = _mm_sub_ps( farPlane, b.Omax ), f2 = _mm_sub_ps( farPlane, b.Omin );
+	const __m128 lower = _mm_min_ps( _mm_min_ps( _mm_mul_ps( n1, b.rDmin ), _mm_mul_ps( n1, b.rDmax ) ), _mm_min_ps( _mm_mul_ps( n2, b.rDmin ), _mm_mul_ps( n2, b.rDmax ) ) );
+	const __m128 upper = _mm_max_ps( _mm_max_ps( _mm_mul_ps( f1, b.rDmin ), _mm_mul_ps( f1, b.rDmax ) ), _mm_max_ps( _mm_mul_ps( f2, b.rDmin ), _mm_mul_ps( f2, b.rDmax ) ) );
+	const float entry = max( max( lower.m128_f32[0], lower.m128_f32[1] ), lower.m128_f32[2] );
+	const float exit = min( min( upper.m128_f32[0], upper.m128_f32[1] ), upper.m128_f32[2] );
+	return entry > exit || exit <= 0 || entry >= tmax;
+}
+
+template <int N, class Node> uint IntersectAABBPacket( const RayPacket<N>& packet, const PacketBounds& bounds, const Node& node, const uint laneMask, float& dist )
+{
+	// returns the lanes of laneMask whose rays hit the box, and their nearest entry distance
+	dist = 1e30f;
+	if (bounds.valid && PacketMissesBox( bounds, node.aabbMin4, node.aabbMax4, MaxT( packet, laneMask ) )) return 0;
+	const __m128 xmin4 = _mm_set1_ps( node.aabbMin.x ), ymin4 = _mm_set1_ps( node.aabbMin.y ), zmin4 = _mm_set1_ps( node.aabbMin.z );
+	const __m128 xmax4 = _mm_set1_ps( node.aabbMax.x ), ymax4 = _mm_set1_ps( node.aabbMax.y ), zmax4 = _mm_set1_ps( node.aabbMax.z );
+	__m128 nearest4 = _mm_set1_ps( 1e30f );
+	uint hitMask = 0;
+	for (int g = 0; g < N / 4; g++) if ((laneMask >> (4 * g)) & 15)
+	{
+		const __m128 tx1 = _mm_mul_ps( _mm_sub_ps( xmin4, packet.O4[0][g] ), packet.rD4[0][g] );
+		const __m128 tx2 = _mm_mul_ps( _mm_sub_ps( xmax4, packet.O4[0][g] ), packet.rD4[0][g] );
+		const __m128 ty1 = _mm_mul_ps( _mm_sub_ps( ymin4, packet.O4[1][g] ), packet.rD4[1][g] );
+		const __m128 ty2 = _mm_mul_ps( _mm_sub_ps( ymax4, packet.O4[1][g] ), packet.rD4[1][g] );
+		const __m128 tz1 = _mm_mul_ps( _mm_sub_ps( zmin4, packet.O4[2][g] ), packet.rD4[2][g] );
+		const __m128 tz2 = _mm_mul_ps( _mm_sub_ps( zmax4, packet.O4[2][g] ), packet.rD4[2][g] );
+		const __m128 tmin4 = _mm_max_ps( _mm_max_ps( _mm_min_ps( tx1, tx2 ), _mm_min_ps( ty1, ty2 ) ), _mm_min_ps( tz1, tz2 ) );
+		const __m128 tmax4 = _mm_min_ps( _mm_min_ps( _mm_max_ps( tx1, tx2 ), _mm_max_ps( ty1, ty2 ) ), _mm_max_ps( tz1, tz2 ) );
+		const __m128 hit4 = _mm_and_ps( _mm_and_ps( _mm_cmpge_ps( tmax4, tmin4 ), _mm_cmplt_ps( tmin4, packet.t4[g] ) ), _mm_cmpgt_ps( tmax4, _mm_setzero_ps() ) );
+		const uint hits = _mm_movemask_ps( hit4 ) & (laneMask >> (4 * g));
+		if (!hits) continue;
+		hitMask |= hits << (4 * g);
+		nearest4 = _mm_min_ps( nearest4, _mm_blendv_ps( _mm_set1_ps( 1e30f ), tmin4, LaneMask4( hits ) ) );
+	}
+	dist = min( min( nearest4.m128_f32[0], nearest4.m128_f32[1] ), min( nearest4.m128_f32[2], nearest4.m128_f32[3] ) );
+	return hitMask;
+}
+
+template <int N> void IntersectTriPacket( RayPacket<N>& packet, const Tri& tri, const uint instPrim, const uint laneMask )
+{
+	// IntersectTri for four rays at a time; rays outside laneMask keep their hits
+	const float3 edge1 = tri.vertex1 - tri.vertex0, edge2 = tri.vertex2 - tri.vertex0;
+	const __m128 e1x = _mm_set1_ps( edge1.x ), e1y = _mm_set1_ps( edge1.y ), e1z = _mm_set1_ps( edge1.z );
+	const __m128 e2x = _mm_set1_ps( edge2.x ), e2y = _mm_set1_ps( edge2.y ), e2z = _mm_set1_ps( edge2.z );
+	const __m128 v0x = _mm_set1_ps( tri.vertex0.x ), v0y = _mm_set1_ps( tri.vertex0.y ), v0z = _mm_set1_ps( tri.vertex0.z );
+	const __m128 zero4 = _mm_setzero_ps(), one4 = _mm_set1_ps( 1 );
+	for (int g = 0; g < N / 4; g++)
+	{
+		const uint bits = (laneMask >> (4 * g)) & 15;
+		if (!bits) continue;
+		const __m128 Dx = packet.D4[0][g], Dy = packet.D4[1][g], Dz = packet.D4[2][g];
+		const __m128 hx = _mm_sub_ps( _mm_mul_ps( Dy, e2z ), _mm_mul_ps( Dz, e2y ) );
+		const __m128 hy = _mm_sub_ps( _mm_mul_ps( Dz, e2x ), _mm_mul_ps( Dx, e2z ) );
+		const __m128 hz = _mm_sub_ps( _mm_mul_ps( Dx, e2y ), _mm_mul_ps( Dy, e2x ) );
+		const __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( e1x, hx ), _mm_mul_ps( e1y, hy ) ), _mm_mul_ps( e1z, hz ) );
+		__m128 mask = _mm_and_ps( LaneMask4( bits ), _mm_cmpge_ps( _mm_andnot_ps( _mm_set1_ps( -0.0f ), a ), _mm_set1_ps( 0.00001f ) ) );
+		const __m128 f = _mm_div_ps( one4, a );
+		const __m128 sx = _mm_sub_ps( packet.O4[0][g], v0x ), sy = _mm_sub_ps( packet.O4[1][g], v0y ), sz = _mm_sub_ps( packet.O4[2][g], v0z );
+		const __m128 u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( u, zero4 ), _mm_cmple_ps( u, one4 ) ) );
+		const __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, e1z ), _mm_mul_ps( sz, e1y ) );
+		const __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, e1x ), _mm_mul_ps( sx, e1z ) );
+		const __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, e1y ), _mm_mul_ps( sy, e1x ) );
+		const __m128 v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( Dx, qx ), _mm_mul_ps( Dy, qy ) ), _mm_mul_ps( Dz, qz ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( v, zero4 ), _mm_cmple_ps( _mm_add_ps( u, v ), one4 ) ) );
+		const __m128 t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x, qx ), _mm_mul_ps( e2y, qy ) ), _mm_mul_ps( e2z, qz ) ) );
+		mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpgt_ps( t, _mm_set1_ps( 0.0001f ) ), _mm_cmplt_ps( t, packet.t4[g] ) ) );
+		if (!_mm_movemask_ps( mask )) continue;
+		packet.t4[g] = _mm_blendv_ps( packet.t4[g], t, mask );
+		packet.u4[g] = _mm_blendv_ps( packet.u4[g], u, mask );
+		packet.v4[g] = _mm_blendv_ps( packet.v4[g], v, mask );
+		packet.instPrim4[g] = _mm_blendv_ps( packet.instPrim4[g], _mm_castsi128_ps( _mm_set1_epi32( instPrim ) ), mask );
+	}
+}
+
+template <int N> void SetReciprocalDirections( RayPacket<N>& packet )
+{
+	for (int a = 0; a < 3; a++) for (int g = 0; g < N / 4; g++)
+		packet.rD4[a][g] = _mm_div_ps( _mm_set1_ps( 1 ), packet.D4[a][g] );
+}
+
+template <int N, class Node, class LeafFunc> void IntersectPacketBinary( RayPacket<N>& packet, const Node* node, uint laneMask, LeafFunc intersectLeaf )
+{
+	// each node is fetched once for the whole packet. a child box is first tested against
+	// the interval bounds of the packet, then against the rays that reached its parent.
+	const PacketBounds bounds = BoundPacket( packet );
+	struct { uint nodeIdx, laneMask; float dist; } stack[64];
+	uint nodeIdx = 0, stackPtr = 0;
+	while (1)
+	{
+		const Node& n = node[nodeIdx];
+		if (IsLeaf( n )) intersectLeaf( LeafFirst( n ), LeafCount( n ), laneMask );
+		else
+		{
+			uint child[2] = { LeftChild( n ), RightChild( n ) }, mask[2];
+			float dist[2];
+			for (int i = 0; i < 2; i++) mask[i] = IntersectAABBPacket( packet, bounds, node[child[i]], laneMask, dist[i] );
+			if (dist[0] > dist[1]) swap( dist[0], dist[1] ), swap( child[0], child[1] ), swap( mask[0], mask[1] );
+			if (mask[0])
+			{
+				// visit the near child with the rays that hit it; push the far child
+				if (mask[1]) stack[stackPtr].nodeIdx = child[1], stack[stackPtr].laneMask = mask[1], stack[stackPtr++].dist = dist[1];
+				nodeIdx = child[0], laneMask = mask[0];
+				continue;
+			}
+		}
+		// pop the nearest node that one of its rays may hit before its current intersection
+		while (stackPtr > 0 && stack[stackPtr - 1].dist >= MaxT( packet, stack[stackPtr - 1].laneMask )) stackPtr--;
+		if (stackPtr == 0) break;
+		nodeIdx = stack[--stackPtr].nodeIdx, laneMask = stack[stackPtr].laneMask;
+	}
+}
+
+// leaf block helpers
+
+inline float* Lanes( __m128& v ) { return v.m128_f32; }
+inline float* Lanes( __m256& v ) { return v.m256_f32; }
+
+template <int K, class Block> void PackTriBlock( Block& block, const Tri* tri, const uint* triIdx, uint first, uint count )
+{
+	// transpose up to K triangles to SoA; unused lanes repeat the last triangle, with zero edges
+	for (uint k = 0; k < K; k++)
+	{
+		const uint prim = triIdx[first + min( k, count - 1 )];
+		const float3 e1 = tri[prim].vertex1 - tri[prim].vertex0, e2 = tri[prim].vertex2 - tri[prim].vertex0;
+		const bool used = k < count;
+		for (int a = 0; a < 3; a++)
+			Lanes( block.v0[a] )[k] = tri[prim].vertex0.cell[a],
+			Lanes( block.e1[a] )[k] = used ? e1.cell[a] : 0,
+			Lanes( block.e2[a] )[k] = used ? e2.cell[a] : 0;
+		block.prim[k] = prim;
+	}
+}
+
+inline void IntersectTri4( const Ray& ray, Intersection& hit, const TriBlock4& tri, const uint instBase )
+{
+	// IntersectTri for one ray and four triangles; of the lanes that hit, the nearest wins
+	const __m128 Dx = _mm_set1_ps( ray.D.x ), Dy = _mm_set1_ps( ray.D.y ), Dz = _mm_set1_ps( ray.D.z );
+	const __m128 hx = _mm_sub_ps( _mm_mul_ps( Dy, tri.e2[2] ), _mm_mul_ps( Dz, tri.e2[1] ) );
+	const __m128 hy = _mm_sub_ps( _mm_mul_ps( Dz, tri.e2[0] ), _mm_mul_ps( Dx, tri.e2[2] ) );
+	const __m128 hz = _mm_sub_ps( _mm_mul_ps( Dx, tri.e2[1] ), _mm_mul_ps( Dy, tri.e2[0] ) );
+	const __m128 a = _mm_add_ps( _mm_add_ps( _mm_mul_ps( tri.e1[0], hx ), _mm_mul_ps( tri.e1[1], hy ) ), _mm_mul_ps( tri.e1[2], hz ) );
+	__m128 mask = _mm_cmpge_ps( _mm_andnot_ps( _mm_set1_ps( -0.0f ), a ), _mm_set1_ps( 0.00001f ) );
+	const __m128 f = _mm_div_ps( _mm_set1_ps( 1 ), a );
+	const __m128 sx = _mm_sub_ps( _mm_set1_ps( ray.O.x ), tri.v0[0] );
+	const __m128 sy = _mm_sub_ps( _mm_set1_ps( ray.O.y ), tri.v0[1] );
+	const __m128 sz = _mm_sub_ps( _mm_set1_ps( ray.O.z ), tri.v0[2] );
+	const __m128 u = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( sx, hx ), _mm_mul_ps( sy, hy ) ), _mm_mul_ps( sz, hz ) ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( u, _mm_setzero_ps() ), _mm_cmple_ps( u, _mm_set1_ps( 1 ) ) ) );
+	const __m128 qx = _mm_sub_ps( _mm_mul_ps( sy, tri.e1[2] ), _mm_mul_ps( sz, tri.e1[1] ) );
+	const __m128 qy = _mm_sub_ps( _mm_mul_ps( sz, tri.e1[0] ), _mm_mul_ps( sx, tri.e1[2] ) );
+	const __m128 qz = _mm_sub_ps( _mm_mul_ps( sx, tri.e1[1] ), _mm_mul_ps( sy, tri.e1[0] ) );
+	const __m128 v = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( Dx, qx ), _mm_mul_ps( Dy, qy ) ), _mm_mul_ps( Dz, qz ) ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpge_ps( v, _mm_setzero_ps() ), _mm_cmple_ps( _mm_add_ps( u, v ), _mm_set1_ps( 1 ) ) ) );
+	const __m128 t = _mm_mul_ps( f, _mm_add_ps( _mm_add_ps( _mm_mul_ps( tri.e2[0], qx ), _mm_mul_ps( tri.e2[1], qy ) ), _mm_mul_ps( tri.e2[2], qz ) ) );
+	mask = _mm_and_ps( mask, _mm_and_ps( _mm_cmpgt_ps( t, _mm_set1_ps( 0.0001f ) ), _mm_cmplt_ps( t, _mm_set1_ps( hit.t ) ) ) );
+	if (!_mm_movemask_ps( mask )) return;
+	// nearest hit: the minimum of the masked distances, then the first lane that holds it
+	const __m128 tm = _mm_blendv_ps( _mm_set1_ps( 1e30f ), t, mask );
+	__m128 tmin = _mm_min_ps( tm, _mm_shuffle_ps( tm, tm, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	tmin = _mm_min_ps( tmin, _mm_shuffle_ps( tmin, tmin, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	const uint best = _tzcnt_u32( _mm_movemask_ps( _mm_and_ps( mask, _mm_cmpeq_ps( tm, tmin ) ) ) );
+	hit.t = t.m128_f32[best], hit.u = u.m128_f32[best], hit.v = v.m128_f32[best], hit.instPrim = instBase + tri.prim[best];
+}
+
+inline void IntersectTri8( const Ray& ray, Intersection& hit, const TriBlock8& tri, const uint instBase )
+{
+	// AVX version of the above, for eight triangles
+	const __m256 Dx = _mm256_set1_ps( ray.D.x ), Dy = _mm256_set1_ps( ray.D.y ), Dz = _mm256_set1_ps( ray.D.z );
+	const __m256 hx = _mm256_sub_ps( _mm256_mul_ps( Dy, tri.e2[2] ), _mm256_mul_ps( Dz, tri.e2[1] ) );
+	const __m256 hy = _mm256_sub_ps( _mm256_mul_ps( Dz, tri.e2[0] ), _mm256_mul_ps( Dx, tri.e2[2] ) );
+	const __m256 hz = _mm256_sub_ps( _mm256_mul_ps( Dx, tri.e2[1] ), _mm256_mul_ps( Dy, tri.e2[0] ) );
+	const __m256 a = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( tri.e1[0], hx ), _mm256_mul_ps( tri.e1[1], hy ) ), _mm256_mul_ps( tri.e1[2], hz ) );
+	__m256 mask = _mm256_cmp_ps( _mm256_andnot_ps( _mm256_set1_ps( -0.0f ), a ), _mm256_set1_ps( 0.00001f ), _CMP_GE_OQ );
+	const __m256 f = _mm256_div_ps( _mm256_set1_ps( 1 ), a );
+	const __m256 sx = _mm256_sub_ps( _mm256_set1_ps( ray.O.x ), tri.v0[0] );
+	const __m256 sy = _mm256_sub_ps( _mm256_set1_ps( ray.O.y ), tri.v0[1] );
+	const __m256 sz = _mm256_sub_ps( _mm256_set1_ps( ray.O.z ), tri.v0[2] );
+	const __m256 u = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( sx, hx ), _mm256_mul_ps( sy, hy ) ), _mm256_mul_ps( sz, hz ) ) );
+	mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( u, _mm256_setzero_ps(), _CMP_GE_OQ ), _mm256_cmp_ps( u, _mm256_set1_ps( 1 ), _CMP_LE_OQ ) ) );
+	const __m256 qx = _mm256_sub_ps( _mm256_mul_ps( sy, tri.e1[2] ), _mm256_mul_ps( sz, tri.e1[1] ) );
+	const __m256 qy = _mm256_sub_ps( _mm256_mul_ps( sz, tri.e1[0] ), _mm256_mul_ps( sx, tri.e1[2] ) );
+	const __m256 qz = _mm256_sub_ps( _mm256_mul_ps( sx, tri.e1[1] ), _mm256_mul_ps( sy, tri.e1[0] ) );
+	const __m256 v = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( Dx, qx ), _mm256_mul_ps( Dy, qy ) ), _mm256_mul_ps( Dz, qz ) ) );
+	mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( v, _mm256_setzero_ps(), _CMP_GE_OQ ), _mm256_cmp_ps( _mm256_add_ps( u, v ), _mm256_set1_ps( 1 ), _CMP_LE_OQ ) ) );
+	const __m256 t = _mm256_mul_ps( f, _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( tri.e2[0], qx ), _mm256_mul_ps( tri.e2[1], qy ) ), _mm256_mul_ps( tri.e2[2], qz ) ) );
+	mask = _mm256_and_ps( mask, _mm256_and_ps( _mm256_cmp_ps( t, _mm256_set1_ps( 0.0001f ), _CMP_GT_OQ ), _mm256_cmp_ps( t, _mm256_set1_ps( hit.t ), _CMP_LT_OQ ) ) );
+	if (!_mm256_movemask_ps( mask )) return;
+	const __m256 tm = _mm256_blendv_ps( _mm256_set1_ps( 1e30f ), t, mask );
+	__m256 tmin = _mm256_min_ps( tm, _mm256_permute_ps( tm, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+	tmin = _mm256_min_ps( tmin, _mm256_permute_ps( tmin, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+	tmin = _mm256_min_ps( tmin, _mm256_permute2f128_ps( tmin, tmin, 1 ) );
+	const uint best = _tzcnt_u32( _mm256_movemask_ps( _mm256_and_ps( mask, _mm256_cmp_ps( tm, tmin, _CMP_EQ_OQ ) ) ) );
+	hit.t = t.m256_f32[best], hit.u = u.m256_f32[best], hit.v = v.m256_f32[best], hit.instPrim = instBase + tri.prim[best];
+}
+
+// occlusion helpers
+
+inline bool OccludesRay( const Ray& ray, const Tri& tri )
+{
+	// IntersectTri without the intersection record: any hit closer than ray.hit.t occludes
+	const float3 edge1 = tri.vertex1 - tri.vertex0;
+	const float3 edge2 = tri.vertex2 - tri.vertex0;
+	const float3 h = cross( ray.D, edge2 );
+	const float a = dot( edge1, h );
+	if (fabs( a ) < 0.00001f) return false; // ray parallel to triangle
+	const float f = 1 / a;
+	const float3 s = ray.O - tri.vertex0;
+	const float u = f * dot( s, h );
+	if (u < 0 || u > 1) return false;
+	const float3 q = cross( s, edge1 );
+	const float v = f * dot( ray.D, q );
+	if (v < 0 || u + v > 1) return false;
+	const float t = f * dot( edge2, q );
+	return t > 0.0001f && t < ray.hit.t;
+}
+
+inline bool OccludesRay( const Ray& ray, const TriAccel& tri )
+{
+	const float t = -(dot( tri.W, ray.O ) + tri.dw) / dot( tri.W, ray.D );
+	if (!(t > 0.0001f && t < ray.hit.t)) return false;
+	const float3 I = ray.O + t * ray.D;
+	const float u = dot( tri.U, I ) + tri.du, v = dot( tri.V, I ) + tri.dv;
+	return u >= 0 && v >= 0 && u + v <= 1;
+}
+
+template <class Node, class LeafFunc> bool IsOccludedBinary( const Ray& ray, const Node* node, LeafFunc occludedLeaf )
+{
+	// any-hit traversal: children are visited in their stored order instead of nearest
+	// first, and the first leaf that reports a hit ends the query
+	uint nodeIdx = 0, stack[64], stackPtr = 0;
+	while (1)
+	{
+		const Node& n = node[nodeIdx];
+		if (IsLeaf( n ))
+		{
+			if (occludedLeaf( LeafFirst( n ), LeafCount( n ) )) return true;
+			if (stackPtr == 0) return false; else nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		const uint child1 = LeftChild( n ), child2 = RightChild( n );
+#ifdef USE_SSE
+		const bool hit1 = IntersectAABB_SSE( ray, node[child1].aabbMin4, node[child1].aabbMax4 ) != 1e30f;
+		const bool hit2 = IntersectAABB_SSE( ray, node[child2].aabbMin4, node[child2].aabbMax4 ) != 1e30f;
+#else
+		const bool hit1 = IntersectAABB( ray, node[child1].aabbMin, node[child1].aabbMax ) != 1e30f;
+		const bool hit2 = IntersectAABB( ray, node[child2].aabbMin, node[child2].aabbMax ) != 1e30f;
+#endif
+		if (hit1) { nodeIdx = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) nodeIdx = child2;
+		else if (stackPtr == 0) return false; else nodeIdx = stack[--stackPtr];
+	}
+}
+
+template <int W, class WideNode, class LeafFunc> bool IsOccludedWide( const Ray& ray, const WideNode* wideNode, LeafFunc occludedLeaf )
+{
+	// any-hit traversal of a wide tree: leaf children are tested right away, interior
+	// children are pushed unsorted
+	const int sign[3] = { ray.rD.x < 0 ? 3 : 0, ray.rD.y < 0 ? 3 : 0, ray.rD.z < 0 ? 3 : 0 };
+	uint nodeIdx = 0, stack[64 * (W - 1)], stackPtr = 0;
+	while (1)
+	{
+		uint child[W], count[W];
+		float dist[W];
+		const uint hits = IntersectChildren( ray, sign, wideNode[nodeIdx], child, count, dist );
+		for (uint i = 0; i < hits; i++)
+			if (!count[i]) stack[stackPtr++] = child[i];
+			else if (occludedLeaf( child[i], count[i] )) return true;
+		if (stackPtr == 0) return false;
+		nodeIdx = stack[--stackPtr];
+	}
+}
+
+// binned SAH evaluation
+
+// bins for one slice of triangles, for all three axes. each bin box is stored as
+// eight floats: min.xyz in the low half and -max.xyz in the high half, so that a
+// single _mm256_min_ps grows both bounds.
+template <int B> struct SAHBins
+{
+	__m256 box8[3][B];
+	uint count[3][B];
+	void Reset()
+	{
+		for (int a = 0; a < 3; a++) for (int i = 0; i < B; i++)
+			box8[a][i] = _mm256_set1_ps( 1e30f ), count[a][i] = 0;
+	}
+	void Grow( const int a, const int binIdx, const __m256 triBox8 )
+	{
+		count[a][binIdx]++;
+		box8[a][binIdx] = _mm256_min_ps( box8[a][binIdx], triBox8 );
+	}
+	void Merge( const SAHBins& other )
+	{
+		for (int a = 0; a < 3; a++) for (int i = 0; i < B; i++)
+			count[a][i] += other.count[a][i],
+			box8[a][i] = _mm256_min_ps( box8[a][i], other.box8[a][i] );
+	}
+	float Sweep( const float scale[3], int& axis, int& splitPos, const uint blockSize = 1 ) const;
+	void ChildBoxes( const int axis, const int splitPos, aabb& leftBox, aabb& rightBox ) const;
+};
+
+inline __m256 TriBox8( const Tri& tri )
+{
+	const __m128 bmin4 = _mm_min_ps( tri.v0, _mm_min_ps( tri.v1, tri.v2 ) );
+	const __m128 bmax4 = _mm_max_ps( tri.v0, _mm_max_ps( tri.v1, tri.v2 ) );
+	return _mm256_insertf128_ps( _mm256_castps128_ps256( bmin4 ), _mm_sub_ps( _mm_setzero_ps(), bmax4 ), 1 );
+}
+
+inline float HalfArea( const __m256 box8 )
+{
+	// box extent is max - min, i.e. -(high half + low half)
+	const __m128 e = _mm_sub_ps( _mm_setzero_ps(), _mm_add_ps( _mm256_castps256_ps128( box8 ), _mm256_extractf128_ps( box8, 1 ) ) );
+	return _mm_cvtss_f32( _mm_dp_ps( e, _mm_shuffle_ps( e, e, 9 /* yzx */ ), 0x7f ) );
+}
+
+template <int B> float SAHBins<B>::Sweep( const float scale[3], int& axis, int& splitPos, const uint blockSize ) const
+{
+	// calculate SAH cost for the B - 1 planes between the bins of each axis; with leaf
+	// blocks, a side costs one intersection per block of blockSize triangles
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++) if (scale[a] > 0)
+	{
+		float leftCountArea[B - 1], rightCountArea[B - 1];
+		int leftSum = 0, rightSum = 0;
+		__m256 leftBox8 = _mm256_set1_ps( 1e30f ), rightBox8 = leftBox8;
+		for (int i = 0; i < B - 1; i++)
+		{
+			leftSum += count[a][i];
+			rightSum += count[a][B - 1 - i];
+			leftBox8 = _mm256_min_ps( leftBox8, box8[a][i] );
+			rightBox8 = _mm256_min_ps( rightBox8, box8[a][B - 1 - i] );
+			leftCountArea[i] = leftSum ? ((leftSum + blockSize - 1) / blockSize) * HalfArea( leftBox8 ) : 1e30f;
+			rightCountArea[B - 2 - i] = rightSum ? ((rightSum + blockSize - 1) / blockSize) * HalfArea( rightBox8 ) : 1e30f;
+		}
+		for (int i = 0; i < B - 1; i++)
+		{
+			const float planeCost = leftCountArea[i] + rightCountArea[i];
+			if (planeCost < bestCost)
+				axis = a, splitPos = i + 1, bestCost = planeCost;
+		}
+	}
+	return bestCost;
+}
+
+template <int B> void SAHBins<B>::ChildBoxes( const int axis, const int splitPos, aabb& leftBox, aabb& rightBox ) const
+{
+	// the bins hold the exact triangle bounds, so the children need no extra pass
+	__m256 child8[2] = { _mm256_set1_ps( 1e30f ), _mm256_set1_ps( 1e30f ) };
+	for (int i = 0; i < B; i++) child8[i >= splitPos] = _mm256_min_ps( child8[i >= splitPos], box8[axis][i] );
+	aabb* box[2] = { &leftBox, &rightBox };
+	for (int i = 0; i < 2; i++)
+	{
+		__m128 bmin4 = _mm256_castps256_ps128( child8[i] );
+		__m128 bmax4 = _mm_sub_ps( _mm_setzero_ps(), _mm256_extractf128_ps( child8[i], 1 ) );
+		box[i]->bmin = *(float3*)&bmin4, box[i]->bmax = *(float3*)&bmax4;
+	}
+}
+
+template <int B> void BinTriangles_SSE( SAHBins<B>& bins, const Tri* tri, float* const centroid[3], const uint* idx, const uint count, const float3& cmin, const float scale[3] )
+{
+	// reference kernel: one triangle per iteration
+	for (uint i = 0; i < count; i++)
+	{
+		const __m256 triBox8 = TriBox8( tri[idx[i]] );
+		for (int a = 0; a < 3; a++)
+			bins.Grow( a, min( B - 1, (int)((centroid[a][idx[i]] - cmin.cell[a]) * scale[a]) ), triBox8 );
+	}
+}
+
+template <int B> void BinTriangles_AVX2( SAHBins<B>& bins, const Tri* tri, float* const centroid[3], const uint* idx, const uint count, const float3& cmin, const float scale[3] )
+{
+	// eight triangles per iteration: centroids are gathered and converted to
+	// bin indices for all three axes before the bins are grown
+	__declspec(align(32)) int binIdx[3][8];
+	const __m256 maxBin8 = _mm256_set1_ps( (float)(B - 1) );
+	uint i = 0;
+	for (; i + 8 <= count; i += 8)
+	{
+		const __m256i idx8 = _mm256_loadu_si256( (const __m256i*)(idx + i) );
+		for (int a = 0; a < 3; a++)
+		{
+			const __m256 c8 = _mm256_i32gather_ps( centroid[a], idx8, 4 );
+			const __m256 pos8 = _mm256_mul_ps( _mm256_sub_ps( c8, _mm256_set1_ps( cmin.cell[a] ) ), _mm256_set1_ps( scale[a] ) );
+			_mm256_store_si256( (__m256i*)binIdx[a], _mm256_cvttps_epi32( _mm256_min_ps( pos8, maxBin8 ) ) );
+		}
+		for (int j = 0; j < 8; j++)
+		{
+			const __m256 triBox8 = TriBox8( tri[idx[i + j]] );
+			bins.Grow( 0, binIdx[0][j], triBox8 );
+			bins.Grow( 1, binIdx[1][j], triBox8 );
+			bins.Grow( 2, binIdx[2][j], triBox8 );
+		}
+	}
+	BinTriangles_SSE( bins, tri, centroid, idx + i, count - i, cmin, scale );
+}
+
+template <int B> void BinTriangles_AVX512( SAHBins<B>& bins, const Tri* tri, float* const centroid[3], const uint* idx, const uint count, const float3& cmin, const float scale[3] )
+{
+	// sixteen triangles per iteration; same approach as the AVX2 kernel
+	__declspec(align(64)) int binIdx[3][16];
+	const __m512 maxBin16 = _mm512_set1_ps( (float)(B - 1) );
+	uint i = 0;
+	for (; i + 16 <= count; i += 16)
+	{
+		const __m512i idx16 = _mm512_loadu_si512( idx + i );
+		for (int a = 0; a < 3; a++)
+		{
+			const __m512 c16 = _mm512_i32gather_ps( idx16, centroid[a], 4 );
+			const __m512 pos16 = _mm512_mul_ps( _mm512_sub_ps( c16, _mm512_set1_ps( cmin.cell[a] ) ), _mm512_set1_ps( scale[a] ) );
+			_mm512_store_si512( binIdx[a], _mm512_cvttps_epi32( _mm512_min_ps( pos16, maxBin16 ) ) );
+		}
+		for (int j = 0; j < 16; j++)
+		{
+			const __m256 triBox8 = TriBox8( tri[idx[i + j]] );
+			bins.Grow( 0, binIdx[0][j], triBox8 );
+			bins.Grow( 1, binIdx[1][j], triBox8 );
+			bins.Grow( 2, binIdx[2][j], triBox8 );
+		}
+	}
+	BinTriangles_SSE( bins, tri, centroid, idx + i, count - i, cmin, scale );
+}
+
+template <int B> void BinTriangles( SAHBins<B>& bins, const Tri* tri, float* const centroid[3], const uint* idx, const uint count, const float3& cmin, const float scale[3] )
+{
+	// pick the widest kernel the CPU supports
+	bins.Reset();
+	if (CPUCaps::HW_AVX512F) BinTriangles_AVX512( bins, tri, centroid, idx, count, cmin, scale );
+	else if (CPUCaps::HW_AVX2) BinTriangles_AVX2( bins, tri, centroid, idx, count, cmin, scale );
+	else BinTriangles_SSE( bins, tri, centroid, idx, count, cmin, scale );
+}
+
+// Morton codes for linear BVH building
+
+inline uint64_t MortonSpread( uint64_t v )
+{
+	// insert two zero bits between each of the lowest 21 bits of v
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffffull;
+	v = (v | v << 16) & 0x1f0000ff0000ffull;
+	v = (v | v << 8) & 0x100f00f00f00f00full;
+	v = (v | v << 4) & 0x10c30c30c30c30c3ull;
+	v = (v | v << 2) & 0x1249249249249249ull;
+	return v;
+}
+
+// scratch node for bottom-up building: merged clusters are not adjacent in memory,
+// so the children are stored explicitly. nodes below triCount are leaves.
+struct PLOCNode
+{
+	float3 aabbMin; uint left;
+	float3 aabbMax; uint right;
+};
+
+// spatial split BVH building
+
+// reference to a triangle, or to the part of it that lies inside box
+struct SBVHRef
+{
+	aabb box;
+	uint triIdx;
+};
+
+// bins for the spatial split search: each reference is clipped into the bins it
+// spans; entry and exit count the references that start and end in each bin.
+struct SpatialBin
+{
+	aabb box;
+	uint entry, exit;
+};
+
+inline bool IsValid( const aabb& box )
+{
+	return box.bmin.x <= box.bmax.x && box.bmin.y <= box.bmax.y && box.bmin.z <= box.bmax.z;
+}
+
+inline float SAHCost( const aabb& box, const uint count ) { return count ? box.area() * count : 0; }
+
+inline float Center( const SBVHRef& ref, const int axis ) { return ref.box.bmin.cell[axis] + ref.box.bmax.cell[axis]; }
+
+void SplitReference( const Tri& tri, const SBVHRef& ref, const int axis, const float pos, SBVHRef& left, SBVHRef& right )
+{
+	// clip the triangle against the plane and bound the parts on either side
+	left.box = right.box = aabb();
+	left.triIdx = right.triIdx = ref.triIdx;
+	const float3* vertex[3] = { &tri.vertex0, &tri.vertex1, &tri.vertex2 };
+	for (int i = 0; i < 3; i++)
+	{
+		const float3& v0 = *vertex[i], & v1 = *vertex[(i + 1) % 3];
+		const float p0 = v0.cell[axis], p1 = v1.cell[axis];
+		if (p0 <= pos) left.box.grow( v0 );
+		if (p0 >= pos) right.box.grow( v0 );
+		if ((p0 < pos && p1 > pos) || (p0 > pos && p1 < pos))
+		{
+			float3 p = v0 + (v1 - v0) * clamp( (pos - p0) / (p1 - p0), 0.0f, 1.0f );
+			p.cell[axis] = pos;
+			left.box.grow( p ), right.box.grow( p );
+		}
+	}
+	// the reference may have been clipped before
+	left.box.bmax.cell[axis] = pos, right.box.bmin.cell[axis] = pos;
+	left.box.bmin = fmaxf( left.box.bmin, ref.box.bmin ), left.box.bmax = fminf( left.box.bmax, ref.box.bmax );
+	right.box.bmin = fmaxf( right.box.bmin, ref.box.bmin ), right.box.bmax = fminf( right.box.bmax, ref.box.bmax );
+}
+
+// top-down builder with full-sweep object splits and binned spatial splits. the
+// references live on a stack: a node owns the topmost references, the references
+// of its left child are kept while the right child is built on top of them.
+class SBVHBuilder
+{
+public:
+	SBVHBuilder( BVH& target, const Tri* triangles, const uint triCount, const uint refLimit, const float alpha ) : bvh( target ), tri( triangles )
+	{
+		maxRefs = refLimit, refCount = triCount;
+		ref = new SBVHRef[maxRefs];
+		rightCost = new float[maxRefs];
+		for (uint i = 0; i < triCount; i++)
+		{
+			ref[i].triIdx = i;
+			ref[i].box.grow( tri[i].vertex0 );
+			ref[i].box.grow( tri[i].vertex1 );
+			ref[i].box.grow( tri[i].vertex2 );
+			rootBox.grow( ref[i].box );
+		}
+		minOverlap = rootBox.area() * alpha;
+	}
+	~SBVHBuilder() { delete[] ref; delete[] rightCost; }
+	void Subdivide( uint nodeIdx, uint first, uint count );
+	uint maxRefs, refCount, idxCount = 0;
+private:
+	float FindObjectSplit( SBVHRef* nodeRef, uint count, int& axis, uint& leftCount, float& overlap );
+	float FindSpatialSplit( SBVHRef* nodeRef, uint count, const aabb& nodeBox, int& axis, float& pos );
+	uint PartitionSpatial( uint first, uint& count, int axis, float pos );
+	void SortRefs( SBVHRef* nodeRef, uint count, int axis )
+	{
+		sort( nodeRef, nodeRef + count, [axis]( const SBVHRef& a, const SBVHRef& b ) {
+			float ca = Center( a, axis ), cb = Center( b, axis );
+			return ca != cb ? ca < cb : a.triIdx < b.triIdx;
+		} );
+	}
+	BVH& bvh;
+	const Tri* tri;
+	SBVHRef* ref;
+	float* rightCost; // scratch space for the sweeps
+	aabb rootBox;
+	float minOverlap;
+};
+
+void SBVHBuilder::Subdivide( uint nodeIdx, uint first, uint count )
+{
+	// bounds of the node are the union of the (clipped) reference bounds
+	SBVHRef* nodeRef = ref + first;
+	aabb nodeBox;
+	for (uint i = 0; i < count; i++) nodeBox.grow( nodeRef[i].box );
+	BVHNode& node = bvh.bvhNode[nodeIdx];
+	node.aabbMin = nodeBox.bmin, node.aabbMax = nodeBox.bmax;
+	// find the best object split and, if its children overlap, the best spatial split
+	int axis = 0, spatialAxis = 0;
+	uint leftCount = 0, objectLeftCount = 0;
+	float overlap = 0, spatialPos = 0, spatialCost = 1e30f;
+	float splitCost = count > 1 ? FindObjectSplit( nodeRef, count, axis, objectLeftCount, overlap ) : 1e30f;
+	if (overlap > minOverlap && refCount < maxRefs)
+		spatialCost = FindSpatialSplit( nodeRef, count, nodeBox, spatialAxis, spatialPos );
+	// terminate recursion
+	if (min( splitCost, spatialCost ) >= SAHCost( nodeBox, count ))
+	{
+		node.leftFirst = idxCount, node.triCount = count;
+		for (uint i = 0; i < count; i++) bvh.triIdx[idxCount++] = nodeRef[i].triIdx;
+		return;
+	}
+	if (spatialCost < splitCost)
+	{
+		// spatial split; references that straddle the plane may be duplicated. if
+		// unsplitting moved everything to one side, use the object split after all.
+		leftCount = PartitionSpatial( first, count, spatialAxis, spatialPos );
+		if (leftCount == 0 || leftCount == count) spatialCost = 1e30f;
+	}
+	if (spatialCost >= splitCost) SortRefs( nodeRef, count, axis ), leftCount = objectLeftCount;
+	// create child nodes; the right child owns the top of the stack, so it goes first
+	uint leftChildIdx = bvh.nodesUsed++, rightChildIdx = bvh.nodesUsed++;
+	node.leftFirst = leftChildIdx, node.triCount = 0;
+	Subdivide( rightChildIdx, first + leftCount, count - leftCount );
+	Subdivide( leftChildIdx, first, leftCount );
+	bvh.bvhNode[nodeIdx].SetSplitAxis( bvh.bvhNode[leftChildIdx], bvh.bvhNode[rightChildIdx] );
+}
+
+float SBVHBuilder::FindObjectSplit( SBVHRef* nodeRef, uint count, int& axis, uint& leftCount, float& overlap )
+{
+	// full sweep: sort the references by centroid and evaluate every split position
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++)
+	{
+		SortRefs( nodeRef, count, a );
+		aabb rightBox, leftBox;
+		for (uint i = count - 1; i > 0; i--)
+			rightBox.grow( nodeRef[i].box ),
+			rightCost[i] = SAHCost( rightBox, count - i );
+		for (uint i = 1; i < count; i++)
+		{
+			leftBox.grow( nodeRef[i - 1].box );
+			const float cost = SAHCost( leftBox, i ) + rightCost[i];
+			if (cost < bestCost) bestCost = cost, axis = a, leftCount = i;
+		}
+	}
+	// overlap of the child boxes decides whether spatial splits are worth a try
+	SortRefs( nodeRef, count, axis );
+	aabb leftBox, rightBox;
+	for (uint i = 0; i < count; i++) (i < leftCount ? leftBox : rightBox).grow( nodeRef[i].box );
+	aabb overlapBox;
+	overlapBox.bmin = fmaxf( leftBox.bmin, rightBox.bmin );
+	overlapBox.bmax = fminf( leftBox.bmax, rightBox.bmax );
+	overlap = IsValid( overlapBox ) ? overlapBox.area() : 0;
+	return bestCost;
+}
+
+float SBVHBuilder::FindSpatialSplit( SBVHRef* nodeRef, uint count, const aabb& nodeBox, int& axis, float& pos )
+{
+	float bestCost = 1e30f;
+	for (int a = 0; a < 3; a++)
+	{
+		const float nodeMin = nodeBox.bmin.cell[a], extent = nodeBox.bmax.cell[a] - nodeMin;
+		if (extent <= 0) continue;
+		const float binWidth = extent / SBVH_BINS, scale = SBVH_BINS / extent;
+		SpatialBin bin[SBVH_BINS];
+		for (int i = 0; i < SBVH_BINS; i++) bin[i].box = aabb(), bin[i].entry = bin[i].exit = 0;
+		// chop each reference into the bins it spans
+		for (uint i = 0; i < count; i++)
+		{
+			SBVHRef part = nodeRef[i], left, right;
+			int firstBin = clamp( (int)((part.box.bmin.cell[a] - nodeMin) * scale), 0, SBVH_BINS - 1 );
+			int lastBin = clamp( (int)((part.box.bmax.cell[a] - nodeMin) * scale), firstBin, SBVH_BINS - 1 );
+			for (int b = firstBin; b < lastBin; b++)
+			{
+				SplitReference( tri[part.triIdx], part, a, nodeMin + binWidth * (b + 1), left, right );
+				if (IsValid( left.box )) bin[b].box.grow( left.box );
+				part = right;
+			}
+			if (IsValid( part.box )) bin[lastBin].box.grow( part.box );
+			bin[firstBin].entry++, bin[lastBin].exit++;
+		}
+		// sweep over the planes between the bins
+		float binRightCost[SBVH_BINS];
+		uint binRightCount[SBVH_BINS], leftSum = 0, rightSum = 0;
+		aabb leftBox, rightBox;
+		for (int i = SBVH_BINS - 1; i > 0; i--)
+			rightBox.grow( bin[i].box ), rightSum += bin[i].exit,
+			binRightCost[i] = SAHCost( rightBox, rightSum ), binRightCount[i] = rightSum;
+		for (int i = 1; i < SBVH_BINS; i++)
+		{
+			leftBox.grow( bin[i - 1].box ), leftSum += bin[i - 1].entry;
+			if (leftSum == 0 || binRightCount[i] == 0) continue;
+			const float cost = SAHCost( leftBox, leftSum ) + binRightCost[i];
+			if (cost < bestCost) bestCost = cost, axis = a, pos = nodeMin + binWidth * i;
+		}
+	}
+	return bestCost;
+}
+
+uint SBVHBuilder::PartitionSpatial( uint first, uint& count, int axis, float pos )
+{
+	// references entirely on one side of the plane go to that side
+	uint leftEnd = first, rightStart = first + count;
+	aabb leftBox, rightBox;
+	for (uint i = leftEnd; i < rightStart; i++)
+	{
+		if (ref[i].box.bmax.cell[axis] <= pos) leftBox.grow( ref[i].box ), swap( ref[i], ref[leftEnd++] );
+		else if (ref[i].box.bmin.cell[axis] >= pos) rightBox.grow( ref[i].box ), swap( ref[i--], ref[--rightStart] );
+	}
+	// straddling references: duplicate them, or 'unsplit' them to one side if that is cheaper
+	while (leftEnd < rightStart)
+	{
+		SBVHRef left, right;
+		SplitReference( tri[ref[leftEnd].triIdx], ref[leftEnd], axis, pos, left, right );
+		const uint leftSum = leftEnd - first, rightSum = first + count - rightStart;
+		aabb leftUnsplit = leftBox, rightUnsplit = rightBox, leftDup = leftBox, rightDup = rightBox;
+		leftUnsplit.grow( ref[leftEnd].box ), rightUnsplit.grow( ref[leftEnd].box );
+		leftDup.grow( left.box ), rightDup.grow( right.box );
+		const float leftCost = SAHCost( leftUnsplit, leftSum + 1 ) + SAHCost( rightBox, rightSum );
+		const float rightCost = SAHCost( leftBox, leftSum ) + SAHCost( rightUnsplit, rightSum + 1 );
+		float dupCost = SAHCost( leftDup, leftSum + 1 ) + SAHCost( rightDup, rightSum + 1 );
+		if (refCount >= maxRefs || !IsValid( left.box ) || !IsValid( right.box )) dupCost = 1e30f;
+		if (dupCost < leftCost && dupCost < rightCost)
+		{
+			leftBox = leftDup, rightBox = rightDup;
+			ref[leftEnd++] = left;
+			ref[first + count++] = right, refCount++;
+		}
+		else if (leftCost <= rightCost) leftBox = leftUnsplit, leftEnd++;
+		else rightBox = rightUnsplit, swap( ref[leftEnd], ref[--rightStart] );
+	}
+	return leftEnd - first;
+}
+
+// Mesh class implementation
+
+Mesh::Mesh( const uint primCount )
+{
+	// basic constructor, for top-down TLAS construction
+	tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 );
+	memset( tri, 0, primCount * sizeof( Tri ) );
+	triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
+	memset( triEx, 0, primCount * sizeof( TriEx ) );
+	triCount = primCount;
+}
+
+Mesh::Mesh( const char* objFile, const char* texFile, const float scale )
+{
+	// bare-bones obj file loader; only supports very basic meshes
+	tri = (Tri*)_aligned_malloc( 25000 * sizeof( Tri ), 64 );
+	triEx = (TriEx*)_aligned_malloc( 25000 * sizeof( TriEx ), 64 );
+	float2* UV = new float2[11042]; // enough for dragon.obj
+	N = new float3[11042], P = new float3[11042];
+	int UVs = 0, Ns = 0, Ps = 0, a, b, c, d, e, f, g, h, i;
+	FILE* file = fopen( objFile, "r" );
+	if (!file) return; // file doesn't exist
+	while (!feof( file ))
+	{
+		char line[512] = { 0 };
+		fgets( line, 511, file );
+		if (line == strstr( line, "vt " ))
+			sscanf( line + 3, "%f %f", &UV[UVs].x, &UV[UVs].y ), UVs++;
+		else if (line == strstr( line, "vn " ))
+			sscanf( line + 3, "%f %f %f", &N[Ns].x, &N[Ns].y, &N[Ns].z ), Ns++;
+		else if (line[0] == 'v')
+			sscanf( line + 2, "%f %f %f", &P[Ps].x, &P[Ps].y, &P[Ps].z ), Ps++;
+		if (line[0] != 'f') continue; else
+			sscanf( line + 2, "%i/%i/%i %i/%i/%i %i/%i/%i",
+				&a, &b, &c, &d, &e, &f, &g, &h, &i );
+		tri[triCount].vertex0 = P[a - 1] * scale, triEx[triCount].N0 = N[c - 1];
+		tri[triCount].vertex1 = P[d - 1] * scale, triEx[triCount].N1 = N[f - 1];
+		tri[triCount].vertex2 = P[g - 1] * scale, triEx[triCount].N2 = N[i - 1];
+		triEx[triCount].uv0 = UV[b - 1], triEx[triCount].uv1 = UV[e - 1];
+		triEx[triCount++].uv2 = UV[h - 1];
+	}
+	fclose( file );
+	bvh = new BVH( this );
+	texture = new Surface( texFile );
+}
+
+// BVH class implementation
+
+BVH::BVH( Mesh* triMesh )
+{
+	mesh = triMesh;
+	Build();
+}
+
+void BVH::Reserve( uint refCount )
+{
+	// grow node and index storage; meshes may gain triangles after the BVH was created
+	if (refCount <= refCapacity) return;
+	_aligned_free( bvhNode );
+	_aligned_free( bvhNodeTemp );
+	delete[] triIdx;
+	delete[] triIdxTemp;
+	delete[] mortonCode;
+	delete[] mortonTemp;
+	_aligned_free( centroid[0] );
+	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * refCount * 2 + 64, 64 );
+	centroid[0] = (float*)_aligned_malloc( refCount * 3 * sizeof( float ), 64 );
+	centroid[1] = centroid[0] + refCount, centroid[2] = centroid[1] + refCount;
+	triIdx = new uint[refCount];
+	triIdxTemp = refCount > PARALLEL_SPLIT_SIZE ? new uint[refCount] : 0;
+	mortonCode = mortonTemp = 0, bvhNodeTemp = 0;
+	refCapacity = refCount;
+}
+
+void BVH::Intersect( Ray& ray, uint instanceIdx )
+{
+	if (width > 2)
+	{
+		// traverse the wide copy of the tree
+		const uint* leafPrim = compressed ? widePrim : leafOrder ? 0 : triIdx;
+		const Tri* tri = leafOrder ? leafTri : mesh->tri;
+		auto intersectLeaf = [&]( uint first, uint count ) {
+			if (leafBlockSize && !compressed) { IntersectLeafBlocks( ray, first, count, instanceIdx ); return; }
+			for (uint i = 0; i < count; i++)
+			{
+				const uint idx = leafPrim ? leafPrim[first + i] : first + i;
+				const uint instPrim = (instanceIdx << 20) + (leafOrder ? triIdx[idx] : idx);
+				if (triAccel) IntersectTri( ray, triAccel[idx], instPrim );
+				else IntersectTri( ray, tri[idx], instPrim );
+			}
+		};
+		if (compressed) IntersectWide<8>( ray, (const BVH8CNode*)wideNode, intersectLeaf );
+		else if (width == 8) IntersectWide<8>( ray, (const BVH8Node*)wideNode, intersectLeaf );
+		else IntersectWide<4>( ray, (const BVH4Node*)wideNode, intersectLeaf );
+		return;
+	}
+	// binary traversal: pick the kernel for the octant of the ray direction once
+	static void (BVH::*kernel[8])( Ray&, uint ) = {
+		&BVH::IntersectOctant<0>, &BVH::IntersectOctant<1>, &BVH::IntersectOctant<2>, &BVH::IntersectOctant<3>,
+		&BVH::IntersectOctant<4>, &BVH::IntersectOctant<5>, &BVH::IntersectOctant<6>, &BVH::IntersectOctant<7> };
+	(this->*kernel[(ray.rD.x < 0 ? 1 : 0) + (ray.rD.y < 0 ? 2 : 0) + (ray.rD.z < 0 ? 4 : 0)])( ray, instanceIdx );
+}
+
+template <int OCTANT> void BVH::IntersectOctant( Ray& ray, uint instanceIdx )
+{
+	// the octant fixes the entry and exit plane of each slab, and with the split axis of the
+	// node it also fixes the near child: a bit test instead of comparing the child distances
+	uint nodeIdx = 0, stack[64], stackPtr = 0;
+	while (1)
+	{
+		const BVHNode& node = bvhNode[nodeIdx];
+		if (node.isLeaf())
+		{
+			IntersectLeaf( ray, node, instanceIdx );
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+			continue;
+		}
+		const uint split = node.triCount >> 29; // see BVHNode
+		const uint nearIdx = node.leftFirst + (((OCTANT >> (split & 3)) ^ (split >> 2)) & 1);
+		const uint farIdx = nearIdx ^ node.leftFirst ^ (node.leftFirst + 1);
+		const bool hitNear = IntersectAABB<OCTANT>( ray, bvhNode[nearIdx] );
+		const bool hitFar = IntersectAABB<OCTANT>( ray, bvhNode[farIdx] );
+		if (hitNear) { nodeIdx = nearIdx; if (hitFar) stack[stackPtr++] = farIdx; }
+		else if (hitFar) nodeIdx = farIdx;
+		else if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+	}
+}
+
+void BVH::IntersectLeaf( Ray& ray, const BVHNode& node, uint instanceIdx )
+{
+	if (leafBlockSize) IntersectLeafBlocks( ray, node.leftFirst, node.triCount, instanceIdx );
+	else if (leafOrder) for (uint i = 0; i < node.triCount; i++)
+	{
+		// consecutive triangles; triIdx only supplies the triangle index of a hit
+		const uint idx = node.leftFirst + i, instPrim = (instanceIdx << 20) + triIdx[idx];
+		if (triAccel) IntersectTri( ray, triAccel[idx], instPrim );
+		else IntersectTri( ray, leafTri[idx], instPrim );
+	}
+	else if (triAccel) for (uint i = 0; i < node.triCount; i++)
+	{
+		uint instPrim = (instanceIdx << 20) + triIdx[node.leftFirst + i];
+		IntersectTri( ray, triAccel[instPrim & 0xfffff], instPrim );
+	}
+	else for (uint i = 0; i < node.triCount; i++)
+	{
+		uint instPrim = (instanceIdx << 20) + triIdx[node.leftFirst + i];
+		IntersectTri( ray, mesh->tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+	}
+}
+
+void BVH::IntersectLeafBlocks( Ray& ray, uint first, uint count, uint instanceIdx )
+{
+	// one SIMD test per block of the leaf
+	const uint block = leafBlockIdx[first];
+	if (leafBlockSize == 8) for (uint i = 0; i < count; i += 8) IntersectTri8( ray, ray.hit, ((const TriBlock8*)leafBlock)[block + i / 8], instanceIdx << 20 );
+	else for (uint i = 0; i < count; i += 4) IntersectTri4( ray, ray.hit, ((const TriBlock4*)leafBlock)[block + i / 4], instanceIdx << 20 );
+}
+
+template <int N> void BVH::Intersect( RayPacket<N>& packet, uint instanceIdx, uint laneMask )
+{
+	// packet traversal of the binary tree, for coherent rays
+	SetReciprocalDirections( packet );
+	IntersectPacketBinary( packet, bvhNode, laneMask & ((1 << N) - 1), [&]( uint first, uint count, uint mask ) {
+		for (uint i = 0; i < count; i++)
+		{
+			uint instPrim = (instanceIdx << 20) + triIdx[first + i];
+			IntersectTriPacket( packet, leafOrder ? leafTri[first + i] : mesh->tri[instPrim & 0xfffff /* 20 bits */], instPrim, mask );
+		}
+	} );
+}
+template void BVH::Intersect( RayPacket4& packet, uint instanceIdx, uint laneMask );
+template void BVH::Intersect( RayPacket8& packet, uint instanceIdx, uint laneMask );
+template void BVH::Intersect( RayPacket16& packet, uint instanceIdx, uint laneMask );
+
+bool BVH::IsOccluded( const Ray& ray, float tmax )
+{
+	// any-hit query for shadow rays: stops at the first triangle closer than tmax.
+	// like Intersect, this expects ray.rD to be set.
+	Ray shadowRay = ray;
+	shadowRay.hit.t = tmax;
+	const uint* leafPrim = compressed ? widePrim : leafOrder ? 0 : triIdx;
+	const Tri* tri = leafOrder ? leafTri : mesh->tri;
+	auto occludedLeaf = [&]( uint first, uint count ) {
+		for (uint i = 0; i < count; i++)
+		{
+			const uint idx = leafPrim ? leafPrim[first + i] : first + i;
+			if (triAccel ? OccludesRay( shadowRay, triAccel[idx] ) : OccludesRay( shadowRay, tri[idx] )) return true;
+		}
+		return false;
+	};
+	if (width == 2) return IsOccludedBinary( shadowRay, bvhNode, occludedLeaf );
+	if (compressed) return IsOccludedWide<8>( shadowRay, (const BVH8CNode*)wideNode, occludedLeaf );
+	if (width == 8) return IsOccludedWide<8>( shadowRay, (const BVH8Node*)wideNode, occludedLeaf );
+	return IsOccludedWide<4>( shadowRay, (const BVH4Node*)wideNode, occludedLeaf );
+}
+
+void BVH::PrecomputeTriangles()
+{
+	// trade 48 bytes per triangle for cheaper leaf tests in single-ray traversal and
+	// occlusion queries. builds, Refit and ReorderTriangles keep the transforms up to date.
+	// the transforms are parallel to leafTri in leaf order, to mesh->tri otherwise.
+	const uint count = leafOrder ? idxCount : mesh->triCount;
+	if (count > triAccelCount)
+		_aligned_free( triAccel ), triAccel = (TriAccel*)_aligned_malloc( count * sizeof( TriAccel ), 64 ), triAccelCount = count;
+	for (uint i = 0; i < count; i++)
+	{
+		// invert the matrix with columns e1, e2 and N = e1 x e2; its determinant is N.N
+		const Tri& tri = leafOrder ? leafTri[i] : mesh->tri[i];
+		const float3 e1 = tri.vertex1 - tri.vertex0, e2 = tri.vertex2 - tri.vertex0, N = cross( e1, e2 );
+		const float NN = dot( N, N ), r = NN > 0 ? 1 / NN : 0; // degenerate triangles never hit
+		TriAccel& acc = triAccel[i];
+		acc.U = cross( e2, N ) * r, acc.du = -dot( acc.U, tri.vertex0 );
+		acc.V = cross( N, e1 ) * r, acc.dv = -dot( acc.V, tri.vertex0 );
+		acc.W = N * r, acc.dw = -dot( acc.W, tri.vertex0 );
+	}
+}
+
+void BVH::Refit()
+{
+	Timer t;
+	for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+	{
+		BVHNode& node = bvhNode[i];
+		if (node.isLeaf())
+		{
+			// leaf node: adjust bounds to contained triangles
+			UpdateNodeBounds( i );
+			continue;
+		}
+		// interior node: adjust bounds to child node bounds
+		BVHNode& leftChild = bvhNode[node.leftFirst];
+		BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+		node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
+		node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+		node.SetSplitAxis( leftChild, rightChild );
+	}
+	if (leafOrder) ReorderTriangles(); // same order, new vertices
+	else if (triAccel) PrecomputeTriangles();
+	if (width > 2) Collapse();
+	if (leafBlockSize) BuildLeafBlocks();
+	printf( "BVH refitted in %.2fms\n", t.elapsed() * 1000 );
+}
+
+void BVH::OptimizeTreelets( uint rounds )
+{
+	// TRBVH-style optimization: each interior node roots a treelet of up to TREELET_SIZE
+	// subtrees, which gets the topology with the lowest SAH cost. nodes of equal height
+	// never overlap, so the heights are processed bottom-up, each in parallel.
+	Timer t;
+	uint* height = new uint[nodesUsed], * order = new uint[nodesUsed];
+	for (uint round = 0; round < rounds; round++)
+	{
+		// children have higher indices than their parents; see RenumberNodes
+		uint maxHeight = 0;
+		for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+		{
+			const BVHNode& node = bvhNode[i];
+			height[i] = node.isLeaf() ? 0 : 1 + max( height[node.leftFirst], height[node.leftFirst + 1] );
+			maxHeight = max( maxHeight, height[i] );
+		}
+		// sort the interior nodes by height
+		uint* levelStart = new uint[maxHeight + 2];
+		memset( levelStart, 0, (maxHeight + 2) * sizeof( uint ) );
+		for (uint i = 0; i < nodesUsed; i++) if (i != 1) levelStart[height[i] + 1]++;
+		for (uint h = 1; h <= maxHeight + 1; h++) levelStart[h] += levelStart[h - 1];
+		for (uint i = 0; i < nodesUsed; i++) if (i != 1) order[levelStart[height[i]]++] = i;
+		for (uint h = maxHeight; h > 0; h--) levelStart[h] = levelStart[h - 1];
+		levelStart[0] = 0;
+		// a treelet needs at least three subtrees, so start at height 2
+		for (uint h = 2; h <= maxHeight; h++)
+		{
+			const int first = levelStart[h], last = levelStart[h + 1];
+		#pragma omp parallel for schedule(dynamic, 64) num_threads(ThreadCount())
+			for (int i = first; i < last; i++) RestructureTreelet( order[i] );
+		}
+		delete[] levelStart;
+		RenumberNodes();
+	}
+	delete[] height;
+	delete[] order;
+	if (width > 2) Collapse();
+	printf( "BVH optimized in %.2fms\n", t.elapsed() * 1000 );
+}
+
+void BVH::OptimizeReinsertion( float budget )
+{
+	// incremental repair for refitted BVHs: subtrees below nodes with poor bounds are
+	// taken out and reinserted where they add the least area, until budget (in
+	// milliseconds) is spent. candidates are the tenth of the interior nodes whose box
+	// is largest compared to the boxes of their children; the smaller child is moved.
+	Timer t;
+	auto Inefficiency = [this]( uint nodeIdx )
+	{
+		const BVHNode& node = bvhNode[nodeIdx];
+		const float childArea = NodeArea( bvhNode[node.leftFirst] ) + NodeArea( bvhNode[node.leftFirst + 1] );
+		return NodeArea( node ) / max( childArea, 1e-20f );
+	};
+	uint* parent = new uint[nodesUsed];
+	float* inefficiency = new float[nodesUsed];
+	uint* candidate = new uint[nodesUsed], candidateCount = 0;
+	parent[0] = 0;
+	for (uint i = 0; i < nodesUsed; i++) if (i != 1 && !bvhNode[i].isLeaf())
+	{
+		const BVHNode& node = bvhNode[i];
+		parent[node.leftFirst] = parent[node.leftFirst + 1] = i;
+		inefficiency[i] = Inefficiency( i );
+		if (i > 0) candidate[candidateCount++] = i;
+	}
+	// worst ten percent, worst first
+	auto Worse = [inefficiency]( uint a, uint b ) { return inefficiency[a] != inefficiency[b] ? inefficiency[a] > inefficiency[b] : a < b; };
+	const uint worst = min( candidateCount, max( 1u, candidateCount / 10 ) );
+	uint moved = 0;
+	if (worst > 0)
+	{
+		nth_element( candidate, candidate + worst - 1, candidate + candidateCount, Worse );
+		sort( candidate, candidate + worst, Worse );
+		const float threshold = inefficiency[candidate[worst - 1]];
+		for (uint i = 0; i < worst && t.elapsed() * 1000 < budget; i++)
+		{
+			// earlier moves may have stored another subtree in the candidate, or changed
+			// its bounds: only move if it still qualifies
+			const uint nodeIdx = candidate[i];
+			if (bvhNode[nodeIdx].isLeaf() || Inefficiency( nodeIdx ) < threshold) continue;
+			const uint left = bvhNode[nodeIdx].leftFirst;
+			if (Reinsert( NodeArea( bvhNode[left] ) < NodeArea( bvhNode[left + 1] ) ? left : left + 1, parent ) != nodeIdx) moved++;
+		}
+	}
+	// moved nodes no longer follow their parents in memory
+	if (moved > 0) RenumberNodes();
+	if (moved > 0 && width > 2) Collapse();
+	delete[] parent;
+	delete[] inefficiency;
+	delete[] candidate;
+}
+
+uint BVH::Reinsert( uint nodeIdx, uint* parent )
+{
+	// remove the node: its sibling takes the place of the parent, freeing a node pair
+	const uint parentIdx = parent[nodeIdx], pair = bvhNode[parentIdx].leftFirst;
+	const BVHNode node = bvhNode[nodeIdx], sibling = bvhNode[nodeIdx == pair ? pair + 1 : pair];
+	bvhNode[parentIdx] = sibling;
+	if (!sibling.isLeaf()) parent[sibling.leftFirst] = parent[sibling.leftFirst + 1] = parentIdx;
+	if (parentIdx > 0) RefitPath( parent[parentIdx], parent );
+	// branch and bound search for the sibling that adds the least area (Bittner et al., 2013):
+	// a candidate costs the area of the new parent plus the growth of its ancestors.
+	struct Candidate { float inducedCost; uint nodeIdx; };
+	auto Greater = []( const Candidate& a, const Candidate& b ) { return a.inducedCost > b.inducedCost; };
+	Candidate queue[256];
+	uint queueSize = 1, best = 0;
+	float bestCost = 1e30f;
+	const float nodeArea = NodeArea( node );
+	queue[0].inducedCost = 0, queue[0].nodeIdx = 0;
+	while (queueSize > 0)
+	{
+		pop_heap( queue, queue + queueSize, Greater );
+		const Candidate c = queue[--queueSize];
+		if (c.inducedCost + nodeArea >= bestCost) break; // no remaining candidate can be better
+		const BVHNode& target = bvhNode[c.nodeIdx];
+		const float3 e = fmaxf( target.aabbMax, node.aabbMax ) - fminf( target.aabbMin, node.aabbMin );
+		const float cost = c.inducedCost + e.x * e.y + e.y * e.z + e.z * e.x;
+		if (cost < bestCost) bestCost = cost, best = c.nodeIdx;
+		const float childInducedCost = cost - NodeArea( target );
+		if (target.isLeaf() || childInducedCost + nodeArea >= bestCost || queueSize > 254) continue;
+		for (uint i = 0; i < 2; i++)
+			queue[queueSize].inducedCost = childInducedCost, queue[queueSize++].nodeIdx = target.leftFirst + i,
+			push_heap( queue, queue + queueSize, Greater );
+	}
+	// insert: the target becomes the parent of its old contents and the node, stored in the free pair
+	const BVHNode target = bvhNode[best];
+	bvhNode[pair] = target, bvhNode[pair + 1] = node;
+	parent[pair] = parent[pair + 1] = best;
+	if (!target.isLeaf()) parent[target.leftFirst] = parent[target.leftFirst + 1] = pair;
+	if (!node.isLeaf()) parent[node.leftFirst] = parent[node.leftFirst + 1] = pair + 1;
+	bvhNode[best].leftFirst = pair, bvhNode[best].triCount = 0;
+	RefitPath( best, parent );
+	return best;
+}
+
+void BVH::RefitPath( uint nodeIdx, const uint* parent )
+{
+	// update the bounds of a node and its ancestors from their children
+	while (1)
+	{
+		BVHNode& node = bvhNode[nodeIdx];
+		node.aabbMin = fminf( bvhNode[node.leftFirst].aabbMin, bvhNode[node.leftFirst + 1].aabbMin );
+		node.aabbMax = fmaxf( bvhNode[node.leftFirst].aabbMax, bvhNode[node.leftFirst + 1].aabbMax );
+		node.SetSplitAxis( bvhNode[node.leftFirst], bvhNode[node.leftFirst + 1] );
+		if (nodeIdx == 0) break;
+		nodeIdx = parent[nodeIdx];
+	}
+}
+
+void BVH::RestructureTreelet( uint rootIdx )
+{
+	// grow the treelet by expanding the subtree with the largest surface area
+	uint leaf[TREELET_SIZE], pairSlot[TREELET_SIZE - 1], leafCount = 2, pairCount = 1;
+	BVHNode& root = bvhNode[rootIdx];
+	leaf[0] = root.leftFirst, leaf[1] = root.leftFirst + 1, pairSlot[0] = root.leftFirst;
+	float oldCost = 0; // sum of the areas of the interior nodes below the root
+	while (leafCount < TREELET_SIZE)
+	{
+		int expand = -1;
+		float largestArea = -1;
+		for (uint i = 0; i < leafCount; i++) if (!bvhNode[leaf[i]].isLeaf())
+		{
+			const float3 e = bvhNode[leaf[i]].aabbMax - bvhNode[leaf[i]].aabbMin;
+			const float area = e.x * e.y + e.y * e.z + e.z * e.x;
+			if (area > largestArea) expand = i, largestArea = area;
+		}
+		if (expand == -1) break;
+		const uint pair = bvhNode[leaf[expand]].leftFirst;
+		oldCost += largestArea;
+		pairSlot[pairCount++] = pair;
+		leaf[expand] = pair, leaf[leafCount++] = pair + 1;
+	}
+	if (leafCount < 3) return;
+	BVHNode leafNode[TREELET_SIZE];
+	for (uint i = 0; i < leafCount; i++) leafNode[i] = bvhNode[leaf[i]];
+	// find the optimal topology for every subset of the subtrees, smallest first;
+	// all proper subsets of a set have a lower index than the set itself.
+	const uint fullSet = (1 << leafCount) - 1;
+	float3 bmin[1 << TREELET_SIZE], bmax[1 << TREELET_SIZE];
+	float cost[1 << TREELET_SIZE];
+	uint split[1 << TREELET_SIZE];
+	for (uint set = 1; set <= fullSet; set++)
+	{
+		const uint lowest = set & (0 - set), rest = set ^ lowest;
+		int lowestIdx = 0;
+		while ((1u << lowestIdx) != lowest) lowestIdx++;
+		if (rest == 0)
+		{
+			bmin[set] = leafNode[lowestIdx].aabbMin, bmax[set] = leafNode[lowestIdx].aabbMax, cost[set] = 0;
+			continue;
+		}
+		bmin[set] = fminf( bmin[rest], leafNode[lowestIdx].aabbMin );
+		bmax[set] = fmaxf( bmax[rest], leafNode[lowestIdx].aabbMax );
+		// try every partition once: the left side always holds the lowest subtree
+		float bestCost = 1e30f;
+		for (uint left = rest; ; left = (left - 1) & rest)
+		{
+			const uint leftSet = left | lowest, rightSet = set ^ leftSet;
+			if (rightSet != 0)
+			{
+				const float partitionCost = cost[leftSet] + cost[rightSet];
+				if (partitionCost < bestCost) bestCost = partitionCost, split[set] = leftSet;
+			}
+			if (left == 0) break;
+		}
+		const float3 e = bmax[set] - bmin[set];
+		cost[set] = bestCost + e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+	const float3 e = bmax[fullSet] - bmin[fullSet];
+	const float newCost = cost[fullSet] - (e.x * e.y + e.y * e.z + e.z * e.x);
+	if (newCost >= oldCost * 0.9999f) return;
+	// rebuild the treelet in its own node pairs
+	uint queueSet[TREELET_SIZE - 1], queueNode[TREELET_SIZE - 1], head = 0, tail = 1, pairPtr = 0;
+	queueSet[0] = fullSet, queueNode[0] = rootIdx;
+	while (head < tail)
+	{
+		const uint set = queueSet[head], nodeIdx = queueNode[head++];
+		const uint pair = pairSlot[pairPtr++], childSet[2] = { split[set], set ^ split[set] };
+		BVHNode& node = bvhNode[nodeIdx];
+		node.leftFirst = pair, node.triCount = 0;
+		for (int i = 0; i < 2; i++)
+		{
+			const uint child = childSet[i];
+			if ((child & (child - 1)) == 0)
+			{
+				int idx = 0;
+				while ((1u << idx) != child) idx++;
+				bvhNode[pair + i] = leafNode[idx];
+				continue;
+			}
+			bvhNode[pair + i].aabbMin = bmin[child], bvhNode[pair + i].aabbMax = bmax[child];
+			queueSet[tail] = child, queueNode[tail++] = pair + i;
+		}
+		node.SetSplitAxis( bvhNode[pair], bvhNode[pair + 1] );
+	}
+}
+
+void BVH::RenumberNodes()
+{
+	// store the nodes in the order of layout; in each order, children follow their parents
+	if (!bvhNodeTemp) bvhNodeTemp = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * max( refCapacity * 2, nodesUsed ) + 64, 64 );
+	nodesUsed = CopyNodesInOrder( bvhNode, bvhNodeTemp, nodesUsed, layout );
+	swap( bvhNode, bvhNodeTemp );
+}
+
+void BVH::Relayout( NodeLayout order )
+{
+	Timer t;
+	layout = order;
+	RenumberNodes();
+	printf( "BVH relayout: %.2fms\n", t.elapsed() * 1000 );
+}
+
+float BVH::CacheMisses( const Ray* rays, uint rayCount, uint cacheSize )
+{
+	// binary traversal of the rays, one after the other, through a simulated cache that sees
+	// only the node fetches; returns the average number of missed 64-byte lines per ray
+	CacheSim cache( cacheSize );
+	for (uint r = 0; r < rayCount; r++)
+	{
+		Ray ray = rays[r];
+		ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z ), ray.hit.t = 1e30f;
+		BVHNode* node = &bvhNode[0], * stack[64];
+		uint stackPtr = 0;
+		cache.Touch( node );
+		while (1)
+		{
+			if (node->isLeaf())
+			{
+				for (uint i = 0; i < node->triCount; i++)
+				{
+					const uint idx = node->leftFirst + i;
+					IntersectTri( ray, leafOrder ? leafTri[idx] : mesh->tri[triIdx[idx]], triIdx[idx] );
+				}
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+				continue;
+			}
+			BVHNode* child1 = &bvhNode[node->leftFirst];
+			BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+			cache.Touch( child1 ), cache.Touch( child2 );
+			float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
+			float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
+			if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
+			if (dist1 == 1e30f)
+			{
+				if (stackPtr == 0) break; else node = stack[--stackPtr];
+			}
+			else
+			{
+				node = child1;
+				if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			}
+		}
+	}
+	return cache.misses / (float)rayCount;
+}
+
+void BVH::SetWidth( uint w, bool compress )
+{
+	// 2 traverses the binary tree; 4 and 8 collapse it to a wide tree. 8 needs AVX2.
+	// compressed 8-wide nodes store the child bounds in 8 bits per plane.
+	width = w >= 8 && CPUCaps::HW_AVX2 ? 8 : w >= 4 ? 4 : 2;
+	compressed = compress && width == 8;
+	if (width > 2) Collapse();
+}
+
+void BVH::SetLeafBlocks( uint size )
+{
+	// 0, 4 or 8 (with AVX2) triangles per SoA block. the current leaves are packed right
+	// away; Build counts blocks rather than triangles in the SAH, so rebuild to fill them.
+	leafBlockSize = size >= 8 && CPUCaps::HW_AVX2 ? 8 : size >= 4 ? 4 : 0;
+	if (leafBlockSize) BuildLeafBlocks();
+}
+
+void BVH::BuildLeafBlocks()
+{
+	// pack the triangles of each leaf reachable from the root into SoA blocks; leaves that
+	// exceed the block size get consecutive blocks
+	if (idxCount > leafBlockIdxCount) delete[] leafBlockIdx, leafBlockIdx = new uint[leafBlockIdxCount = idxCount];
+	const uint K = leafBlockSize;
+	uint stack[64], stackPtr = 0, nodeIdx = 0, blocks = 0;
+	for (int pass = 0; pass < 2; pass++)
+	{
+		// pass 0 counts the blocks, pass 1 packs them
+		if (pass == 1) ReserveWide( leafBlock, leafBlockCapacity, blocks * (K == 8 ? sizeof( TriBlock8 ) : sizeof( TriBlock4 )) );
+		blocks = 0, nodeIdx = 0;
+		while (1)
+		{
+			const BVHNode& node = bvhNode[nodeIdx];
+			if (!node.isLeaf()) { nodeIdx = node.leftFirst, stack[stackPtr++] = node.leftFirst + 1; continue; }
+			leafBlockIdx[node.leftFirst] = blocks;
+			for (uint j = 0; j < node.triCount; j += K, blocks++) if (pass == 1)
+				if (K == 8) PackTriBlock<8>( ((TriBlock8*)leafBlock)[blocks], mesh->tri, triIdx, node.leftFirst + j, min( 8u, node.triCount - j ) );
+				else PackTriBlock<4>( ((TriBlock4*)leafBlock)[blocks], mesh->tri, triIdx, node.leftFirst + j, min( 4u, node.triCount - j ) );
+			if (stackPtr == 0) break; else nodeIdx = stack[--stackPtr];
+		}
+	}
+}
+
+void BVH::Collapse()
+{
+	// the wide tree is a copy: call this again after changing the binary tree.
+	// Refit, the optimizers and the builders do so automatically.
+	const uint maxNodes = nodesUsed / 2 + 2; // each wide node takes at least one binary interior node
+	wideNodesUsed = 0;
+	if (compressed)
+	{
+		if (idxCount > widePrimCount) delete[] widePrim, widePrim = new uint[widePrimCount = idxCount];
+		BVH8CNode* node = (BVH8CNode*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH8CNode ) );
+		uint primsUsed = 0;
+		wideNodesUsed = 1;
+		if (CollapseNodeCompressed( bvhNode, 0, 0, node, wideNodesUsed, leafOrder ? 0 : triIdx, widePrim, primsUsed )) return;
+		// a leaf has more than 255 triangles: use full precision nodes
+		printf( "BVH8 compression: a leaf exceeds 255 triangles, using full precision nodes.\n" );
+		compressed = false, wideNodesUsed = 0;
+	}
+	if (width == 8) CollapseNode<8>( bvhNode, 0, (BVH8Node*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH8Node ) ), wideNodesUsed );
+	else CollapseNode<4>( bvhNode, 0, (BVH4Node*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH4Node ) ), wideNodesUsed );
+}
+
+size_t BVH::Compact()
+{
+	// move the nodes and indices to arrays that fit the tree exactly, and release the
+	// scratch buffers of the builders; the next build allocates everything again.
+	if (refCapacity == 0)
+	{
+		// compacted before; an optimizer may have allocated scratch space since
+		size_t saved = bvhNodeTemp ? sizeof( BVHNode ) * nodesUsed + 64 : 0;
+		_aligned_free( bvhNodeTemp );
+		bvhNodeTemp = 0;
+		return saved;
+	}
+	size_t before = (sizeof( BVHNode ) * refCapacity * 2 + 64) + refCapacity * (sizeof( uint ) + 3 * sizeof( float ));
+	if (bvhNodeTemp) before += sizeof( BVHNode ) * refCapacity * 2 + 64;
+	if (triIdxTemp) before += refCapacity * sizeof( uint );
+	if (mortonCode) before += refCapacity * 2 * sizeof( uint64_t );
+	const size_t after = sizeof( BVHNode ) * nodesUsed + idxCount * sizeof( uint );
+	BVHNode* newNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * nodesUsed, 64 );
+	nodesUsed = CopyNodesInOrder( bvhNode, newNode, nodesUsed, layout );
+	uint* newIdx = new uint[idxCount];
+	memcpy( newIdx, triIdx, idxCount * sizeof( uint ) );
+	_aligned_free( bvhNode );
+	_aligned_free( bvhNodeTemp );
+	_aligned_free( centroid[0] );
+	delete[] triIdx;
+	delete[] triIdxTemp;
+	delete[] mortonCode;
+	delete[] mortonTemp;
+	bvhNode = newNode, triIdx = newIdx;
+	bvhNodeTemp = 0, triIdxTemp = 0, mortonCode = mortonTemp = 0;
+	centroid[0] = centroid[1] = centroid[2] = 0;
+	refCapacity = 0;
+	return before - after;
+}
+
+void BVH::Build()
+{
+	float3 centroidMin, centroidMax;
+	ResetNodes( centroidMin, centroidMax );
+	// split the top of the tree into independent subtrees
+	buildStackPtr = 1;
+	buildStack[0].nodeIdx = 0;
+	buildStack[0].centroidMin = centroidMin;
+	buildStack[0].centroidMax = centroidMax;
+	CreateBuildJobs( false );
+	// subdivide the subtrees in parallel; each job writes to its own node range
+#pragma omp parallel for schedule(dynamic) num_threads(ThreadCount())
+	for (int i = 0; i < buildStackPtr; i++)
+	{
+		BuildJob& job = buildStack[i];
+		job.lastNode = job.firstNode;
+		Subdivide( job.nodeIdx, 0, job.lastNode, job.centroidMin, job.centroidMax );
+	}
+	PackBuildJobs();
+	FinishBuild();
+}
+
+void BVH::BuildLBVH()
+{
+	// linear BVH: sort the triangles along a Morton curve, then split each node
+	// where the highest differing bit of its Morton codes changes.
+	BuildMorton( false );
+}
+
+void BVH::BuildHLBVH()
+{
+	// hybrid: Morton splits for the top of the tree, binned SAH for the clusters
+	// of HLBVH_CLUSTER_SIZE triangles or fewer at the bottom.
+	BuildMorton( true );
+}
+
+void BVH::BuildMorton( bool refine )
+{
+	float3 centroidMin, centroidMax;
+	ResetNodes( centroidMin, centroidMax );
+	SortMorton( centroidMin, centroidMax );
+	buildStackPtr = 1;
+	buildStack[0].nodeIdx = 0;
+	CreateBuildJobs( true );
+#pragma omp parallel for schedule(dynamic) num_threads(ThreadCount())
+	for (int i = 0; i < buildStackPtr; i++)
+	{
+		BuildJob& job = buildStack[i];
+		job.lastNode = job.firstNode;
+		SubdivideMorton( job.nodeIdx, job.lastNode, refine );
+	}
+	const uint topNodes = nodesUsed;
+	PackBuildJobs();
+	// the jobs calculated the bounds of their subtrees; finish the nodes above them
+	for (int i = topNodes - 1; i >= 0; i--) if (i != 1)
+	{
+		BVHNode& node = bvhNode[i];
+		if (node.isLeaf())
+		{
+			UpdateNodeBounds( i );
+			continue;
+		}
+		BVHNode& leftChild = bvhNode[node.leftFirst];
+		BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+		node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
+		node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+		node.SetSplitAxis( leftChild, rightChild );
+	}
+	FinishBuild();
+}
+
+void BVH::BuildPLOC()
+{
+	// bottom-up build (parallel locally-ordered clustering): clusters start as single
+	// triangles in Morton order. each pass merges the clusters that are each other's
+	// nearest neighbor, by surface area, within a window of PLOC_RADIUS clusters.
+	float3 centroidMin, centroidMax;
+	ResetNodes( centroidMin, centroidMax );
+	SortMorton( centroidMin, centroidMax );
+	const int N = idxCount, slices = min( 64, ThreadCount() );
+	PLOCNode* node = new PLOCNode[N * 2];
+	uint* cluster = new uint[N], * nextCluster = new uint[N], * neighbor = new uint[N];
+#pragma omp parallel for schedule(static) num_threads(slices)
+	for (int i = 0; i < N; i++)
+	{
+		const Tri& triangle = BuildTris()[triIdx[i]];
+		node[i].aabbMin = fminf( triangle.vertex0, fminf( triangle.vertex1, triangle.vertex2 ) );
+		node[i].aabbMax = fmaxf( triangle.vertex0, fmaxf( triangle.vertex1, triangle.vertex2 ) );
+		cluster[i] = i;
+	}
+	int clusterCount = N, nodeCount = N;
+	while (clusterCount > 1)
+	{
+		// find the nearest neighbor of each cluster; on a tie the lower index wins,
+		// which guarantees at least one mutual pair per pass
+	#pragma omp parallel for schedule(static) num_threads(slices)
+		for (int i = 0; i < clusterCount; i++)
+		{
+			const PLOCNode& a = node[cluster[i]];
+			const int first = max( 0, i - PLOC_RADIUS ), last = min( clusterCount - 1, i + PLOC_RADIUS );
+			float bestArea = 1e30f;
+			for (int j = first; j <= last; j++) if (j != i)
+			{
+				const PLOCNode& b = node[cluster[j]];
+				const float3 e = fmaxf( a.aabbMax, b.aabbMax ) - fminf( a.aabbMin, b.aabbMin );
+				const float area = e.x * e.y + e.y * e.z + e.z * e.x;
+				if (area < bestArea) bestArea = area, neighbor[i] = j;
+			}
+		}
+		// merge mutual nearest neighbors into the slot of the first one. each slice
+		// counts its merges first, so new nodes are numbered the same for any thread count.
+		uint sliceFirst[65], mergePos[64], keepPos[64];
+		for (int s = 0; s <= slices; s++) sliceFirst[s] = (uint)(((uint64_t)clusterCount * s) / slices);
+	#pragma omp parallel for schedule(static) num_threads(slices)
+		for (int s = 0; s < slices; s++)
+		{
+			uint merges = 0;
+			for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
+				if (neighbor[neighbor[i]] == i && i < neighbor[i]) merges++;
+			mergePos[s] = merges;
+		}
+		uint mergeSum = 0, keepSum = 0;
+		for (int s = 0; s < slices; s++)
+		{
+			uint merges = mergePos[s], removed = 0;
+			mergePos[s] = nodeCount + mergeSum, keepPos[s] = keepSum;
+			for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
+				if (neighbor[neighbor[i]] == i && i > neighbor[i]) removed++;
+			mergeSum += merges, keepSum += sliceFirst[s + 1] - sliceFirst[s] - removed;
+		}
+	#pragma omp parallel for schedule(static) num_threads(slices)
+		for (int s = 0; s < slices; s++)
+		{
+			for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
+			{
+				const uint j = neighbor[i];
+				if (neighbor[j] != i) { nextCluster[keepPos[s]++] = cluster[i]; continue; }
+				if (i > j) continue; // merged by the other cluster
+				PLOCNode& merged = node[mergePos[s]];
+				merged.left = cluster[i], merged.right = cluster[j];
+				merged.aabbMin = fminf( node[cluster[i]].aabbMin, node[cluster[j]].aabbMin );
+				merged.aabbMax = fmaxf( node[cluster[i]].aabbMax, node[cluster[j]].aabbMax );
+				nextCluster[keepPos[s]++] = mergePos[s]++;
+			}
+		}
+		swap( cluster, nextCluster );
+		clusterCount = keepSum, nodeCount += mergeSum;
+	}
+	// convert to the BVHNode layout, where the children of a node are adjacent.
+	// the scratch arrays serve as the stack; it never holds more than N entries.
+	uint* srcStack = nextCluster, * dstStack = neighbor, stackPtr = 1;
+	srcStack[0] = cluster[0], dstStack[0] = 0;
+	while (stackPtr > 0)
+	{
+		const uint srcIdx = srcStack[--stackPtr];
+		const PLOCNode& src = node[srcIdx];
+		BVHNode& dst = bvhNode[dstStack[stackPtr]];
+		dst.aabbMin = src.aabbMin, dst.aabbMax = src.aabbMax;
+		if (srcIdx < (uint)N) { dst.leftFirst = srcIdx, dst.triCount = 1; continue; }
+		dst.leftFirst = nodesUsed, dst.triCount = 0;
+		dst.SetSplitAxis( node[src.left], node[src.right] );
+		srcStack[stackPtr] = src.left, dstStack[stackPtr++] = nodesUsed++;
+		srcStack[stackPtr] = src.right, dstStack[stackPtr++] = nodesUsed++;
+	}
+	delete[] node;
+	delete[] cluster;
+	delete[] nextCluster;
+	delete[] neighbor;
+	FinishBuild();
+}
+
+void BVH::BuildSBVH()
+{
+	// offline-quality build: triangles may be referenced by several leaves, so the
+	// index and node arrays must hold the duplication budget
+	const uint maxRefs = mesh->triCount + (uint)(mesh->triCount * spatialSplitBudget);
+	Reserve( maxRefs );
+	float3 centroidMin, centroidMax;
+	ResetNodes( centroidMin, centroidMax, false );
+	SBVHBuilder builder( *this, mesh->tri, mesh->triCount, maxRefs, spatialSplitAlpha );
+	builder.Subdivide( 0, 0, mesh->triCount );
+	idxCount = builder.idxCount;
+	FinishBuild();
 }
 
-float IntersectAABB_SSE( const Ray& ray, const __m128& bmin4, const __m128& bmax4 )
+void BVH::PreSplit( const float budget )
 {
-	// "slab test" ray/AABB intersection, using SIMD instructions
-	static __m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
-	__m128 t1 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmin4, mask4 ), ray.O4 ), ray.rD4 );
-	__m128 t2 = _mm_mul_ps( _mm_sub_ps( _mm_and_ps( bmax4, mask4 ), ray.O4 ), ray.rD4 );
-	__m128 vmax4 = _mm_max_ps( t1, t2 ), vmin4 = _mm_min_ps( t1, t2 );
-	float tmax = min( vmax4.m128_f32[0], min( vmax4.m128_f32[1], vmax4.m128_f32[2] ) );
-	float tmin = max( vmin4.m128_f32[0], max( vmin4.m128_f32[1], vmin4.m128_f32[2] ) );
-	if (tmax >= tmin && tmin < ray.hit.t && tmax > 0) return tmin; else return 1e30f;
+	// bisect references to triangles whose bounding box is large compared to the triangle
+	// itself, so that the builders see tight boxes; typical for long diagonal triangles.
+	// the reference that gains the most is split first, until budget * triCount references
+	// have been added or no bisection gains enough box area anymore. the mesh is not
+	// modified: after building, the leaves index the original triangles. the references
+	// are used by every subsequent build except BuildSBVH; call again when the triangle
+	// count changes, or with budget 0 to stop pre-splitting.
+	delete[] splitRef;
+	splitRef = 0, splitRefCount = 0;
+	if (budget <= 0) return;
+	const uint maxRefs = mesh->triCount + (uint)(mesh->triCount * budget);
+	splitRef = new SplitRef[maxRefs];
+	struct SplitCandidate { float gain; uint idx; };
+	auto Less = []( const SplitCandidate& a, const SplitCandidate& b ) { return a.gain != b.gain ? a.gain < b.gain : a.idx > b.idx; };
+	SplitCandidate* heap = new SplitCandidate[maxRefs];
+	uint heapSize = 0;
+	int edge;
+	for (int i = 0; i < mesh->triCount; i++)
+	{
+		SplitRef& ref = splitRef[splitRefCount++];
+		ref.corner[0] = float2( 0, 0 ), ref.corner[1] = float2( 1, 0 ), ref.corner[2] = float2( 0, 1 ), ref.prim = i;
+		heap[heapSize].gain = BisectGain( ref, edge ), heap[heapSize++].idx = i;
+	}
+	make_heap( heap, heap + heapSize, Less );
+	while (splitRefCount < maxRefs && heapSize > 0 && heap[0].gain > 0)
+	{
+		pop_heap( heap, heap + heapSize, Less );
+		const uint idx = heap[--heapSize].idx;
+		// bisect the longest edge, from corner a to corner b: the reference keeps (a, m, c),
+		// (m, b, c) is added
+		BisectGain( splitRef[idx], edge );
+		const int a = edge, b = (edge + 1) % 3;
+		const float2 m = (splitRef[idx].corner[a] + splitRef[idx].corner[b]) * 0.5f;
+		SplitRef& added = splitRef[splitRefCount];
+		added = splitRef[idx];
+		splitRef[idx].corner[b] = m, added.corner[a] = m;
+		heap[heapSize].gain = BisectGain( splitRef[idx], edge ), heap[heapSize++].idx = idx;
+		push_heap( heap, heap + heapSize, Less );
+		heap[heapSize].gain = BisectGain( added, edge ), heap[heapSize++].idx = splitRefCount++;
+		push_heap( heap, heap + heapSize, Less );
+	}
+	delete[] heap;
 }
 
-// Mesh class implementation
+void BVH::SplitRefCorners( const SplitRef& ref, float3* corner ) const
+{
+	const Tri& t = mesh->tri[ref.prim];
+	for (int i = 0; i < 3; i++)
+	{
+		const float u = ref.corner[i].x, v = ref.corner[i].y;
+		corner[i] = t.vertex0 * (1 - u - v) + t.vertex1 * u + t.vertex2 * v;
+	}
+}
 
-Mesh::Mesh( const uint primCount )
+float BVH::BisectGain( const SplitRef& ref, int& edge ) const
 {
-	// basic constructor, for top-down TLAS construction
-	tri = (Tri*)_aligned_malloc( primCount * sizeof( Tri ), 64 );
-	memset( tri, 0, primCount * sizeof( Tri ) );
-	triEx = (TriEx*)_aligned_malloc( primCount * sizeof( TriEx ), 64 );
-	memset( triEx, 0, primCount * sizeof( TriEx ) );
-	triCount = primCount;
+	// find the longest edge of the reference, from corner edge to corner edge + 1
+	float3 p[3];
+	SplitRefCorners( ref, p );
+	float longest = -1;
+	for (int i = 0; i < 3; i++)
+	{
+		const float l = sqrLength( p[(i + 1) % 3] - p[i] );
+		if (l > longest) longest = l, edge = i;
+	}
+	// box area of the reference minus the box areas of its halves; small gains do not
+	// pay for the extra reference
+	const float3 pa = p[edge], pb = p[(edge + 1) % 3], pc = p[(edge + 2) % 3], m = (pa + pb) * 0.5f;
+	aabb box, left, right;
+	box.grow( pa ), box.grow( pb ), box.grow( pc );
+	left.grow( pa ), left.grow( m ), left.grow( pc );
+	right.grow( m ), right.grow( pb ), right.grow( pc );
+	const float gain = box.area() - left.area() - right.area();
+	return gain > PRESPLIT_MIN_GAIN * box.area() ? gain : 0;
 }
 
-Mesh::Mesh( const char* objFile, const char* texFile, const float scale )
+void BVH::UpdateSplitRefs()
 {
-	// bare-bones obj file loader; only supports very basic meshes
-	tri = new Tri[25000];
-	triEx = new TriEx[25000];
-	float2* UV = new float2[11042]; // enough for dragon.obj
-	N = new float3[11042], P = new float3[11042];
-	int UVs = 0, Ns = 0, Ps = 0, a, b, c, d, e, f, g, h, i;
-	FILE* file = fopen( objFile, "r" );
-	if (!file) return; // file doesn't exist
-	while (!feof( file ))
+	// proxy triangles for the pre-split references, from the current vertices: vertex0 and
+	// vertex1 span the box of the reference, vertex2 is its center. the box is padded a
+	// little, as the interpolated corners are rounded.
+	if (splitRefCount > refTriCapacity)
 	{
-		char line[512] = { 0 };
-		fgets( line, 511, file );
-		if (line == strstr( line, "vt " ))
-			sscanf( line + 3, "%f %f", &UV[UVs].x, &UV[UVs].y ), UVs++;
-		else if (line == strstr( line, "vn " ))
-			sscanf( line + 3, "%f %f %f", &N[Ns].x, &N[Ns].y, &N[Ns].z ), Ns++;
-		else if (line[0] == 'v')
-			sscanf( line + 2, "%f %f %f", &P[Ps].x, &P[Ps].y, &P[Ps].z ), Ps++;
-		if (line[0] != 'f') continue; else
-			sscanf( line + 2, "%i/%i/%i %i/%i/%i %i/%i/%i",
-				&a, &b, &c, &d, &e, &f, &g, &h, &i );
-		tri[triCount].vertex0 = P[a - 1] * scale, triEx[triCount].N0 = N[c - 1];
-		tri[triCount].vertex1 = P[d - 1] * scale, triEx[triCount].N1 = N[f - 1];
-		tri[triCount].vertex2 = P[g - 1] * scale, triEx[triCount].N2 = N[i - 1];
-		triEx[triCount].uv0 = UV[b - 1], triEx[triCount].uv1 = UV[e - 1];
-		triEx[triCount++].uv2 = UV[h - 1];
+		_aligned_free( refTri );
+		refTri = (Tri*)_aligned_malloc( splitRefCount * sizeof( Tri ), 64 );
+		refTriCapacity = splitRefCount;
+	}
+	for (uint i = 0; i < splitRefCount; i++)
+	{
+		float3 p[3];
+		SplitRefCorners( splitRef[i], p );
+		aabb box;
+		box.grow( p[0] ), box.grow( p[1] ), box.grow( p[2] );
+		const float3 extent = box.bmax - box.bmin;
+		const float pad = max( extent.x, max( extent.y, extent.z ) ) * 1e-5f;
+		refTri[i].vertex0 = box.bmin - pad, refTri[i].vertex1 = box.bmax + pad;
+		refTri[i].vertex2 = (box.bmin + box.bmax) * 0.5f;
 	}
-	fclose( file );
-	bvh = new BVH( this );
-	texture = new Surface( texFile );
 }
 
-// BVH class implementation
+const Tri* BVH::BuildTris() const
+{
+	return refBuild ? refTri : mesh->tri;
+}
 
-BVH::BVH( Mesh* triMesh )
+void BVH::FinishBuild()
 {
-	mesh = triMesh;
-	bvhNode = (BVHNode*)_aligned_malloc( sizeof( BVHNode ) * mesh->triCount * 2 + 64, 64 );
-	triIdx = new uint[mesh->triCount];
-	Build();
+	if (refBuild)
+	{
+		// the leaves of a build from pre-split references index the triangles again
+		for (uint i = 0; i < idxCount; i++) triIdx[i] = splitRef[triIdx[i]].prim;
+		refBuild = false;
+	}
+	// keep the derived data of the previous tree in sync with the new one. the leaf order
+	// of ReorderTriangles does not survive a rebuild; call it again if needed.
+	leafOrder = false;
+	if (triAccel) PrecomputeTriangles();
+	if (leafBlockSize) BuildLeafBlocks();
+	if (width > 2) Collapse();
 }
 
-void BVH::Intersect( Ray& ray, uint instanceIdx )
+void BVH::ReorderTriangles()
 {
-	BVHNode* node = &bvhNode[0], * stack[64];
-	uint stackPtr = 0;
-	while (1)
+	// copy the triangles in the order in which the leaves reference them, so that
+	// traversal reads consecutive triangles instead of following triIdx; hits still
+	// report the index of the triangle in the mesh, which is left untouched. references
+	// duplicated by BuildSBVH become duplicated copies. Refit and Compact keep the copy
+	// up to date; a rebuild drops it.
+	if (idxCount > leafTriCapacity)
 	{
-		if (node->isLeaf())
+		_aligned_free( leafTri );
+		_aligned_free( leafTriEx );
+		leafTri = (Tri*)_aligned_malloc( idxCount * sizeof( Tri ), 64 );
+		leafTriEx = mesh->triEx ? (TriEx*)_aligned_malloc( idxCount * sizeof( TriEx ), 64 ) : 0;
+		leafTriCapacity = idxCount;
+	}
+	const bool reorder = !leafOrder;
+	for (uint i = 0; i < idxCount; i++)
+	{
+		leafTri[i] = mesh->tri[triIdx[i]];
+		if (leafTriEx) leafTriEx[i] = mesh->triEx[triIdx[i]];
+	}
+	leafOrder = true;
+	if (triAccel) PrecomputeTriangles();
+	if (reorder && compressed) Collapse(); // compressed nodes store leaf positions in leaf order
+}
+
+void BVH::ResetNodes( float3& centroidMin, float3& centroidMax, const bool useSplitRefs )
+{
+	// build from the pre-split references if there are any; FinishBuild maps them back
+	refBuild = useSplitRefs && splitRefCount > 0;
+	if (refBuild) UpdateSplitRefs();
+	const int count = refBuild ? splitRefCount : mesh->triCount;
+	Reserve( count );
+	// only 8, 16 and 32 bins are supported
+	binCount = binCount >= 32 ? 32 : binCount >= 16 ? 16 : 8;
+	// reset node pool
+	nodesUsed = 2;
+	memset( bvhNode, 0, count * 2 * sizeof( BVHNode ) );
+	// populate triangle index array
+	for (int i = 0; i < count; i++) triIdx[i] = i;
+	// calculate triangle centroids for partitioning
+	const Tri* tri = BuildTris();
+	for (int i = 0; i < count; i++)
+	{
+		float3 c = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
+		centroid[0][i] = c.x, centroid[1][i] = c.y, centroid[2][i] = c.z;
+	}
+	// assign all triangles to root node
+	BVHNode& root = bvhNode[0];
+	root.leftFirst = 0, root.triCount = count;
+	idxCount = count;
+	UpdateNodeBounds( 0, centroidMin, centroidMax );
+}
+
+void BVH::SortMorton( const float3& centroidMin, const float3& centroidMax )
+{
+	if (!mortonCode) mortonCode = new uint64_t[refCapacity], mortonTemp = new uint64_t[refCapacity];
+	if (!triIdxTemp) triIdxTemp = new uint[refCapacity];
+	// quantize the centroids to a 2^10 or 2^21 grid and interleave the bits
+	const int N = idxCount, threads = ThreadCount();
+	const float gridSize = morton63 ? 2097152.0f : 1024.0f;
+	float scale[3];
+	for (int a = 0; a < 3; a++)
+		scale[a] = centroidMin.cell[a] == centroidMax.cell[a] ? 0 : gridSize / (centroidMax.cell[a] - centroidMin.cell[a]);
+#pragma omp parallel for schedule(static) num_threads(threads)
+	for (int i = 0; i < N; i++)
+	{
+		const float3 p = Centroid( i ) - centroidMin;
+		const uint64_t x = (uint64_t)min( gridSize - 1, p.x * scale[0] );
+		const uint64_t y = (uint64_t)min( gridSize - 1, p.y * scale[1] );
+		const uint64_t z = (uint64_t)min( gridSize - 1, p.z * scale[2] );
+		mortonCode[i] = (MortonSpread( x ) << 2) + (MortonSpread( y ) << 1) + MortonSpread( z );
+	}
+	// stable LSD radix sort of the (code, index) pairs, 8 bits per pass. each thread
+	// counts the digits in its slice; the slices then scatter to disjoint output ranges.
+	// the pass count is even, so the sorted data ends up in mortonCode and triIdx.
+	const int slices = min( 64, threads ), passes = morton63 ? 8 : 4;
+	uint64_t* key = mortonCode, * keyOut = mortonTemp;
+	uint* value = triIdx, * valueOut = triIdxTemp;
+	uint sliceFirst[65], (*digitPos)[256] = new uint[slices][256];
+	for (int s = 0; s <= slices; s++) sliceFirst[s] = (uint)(((uint64_t)N * s) / slices);
+	for (int pass = 0; pass < passes; pass++)
+	{
+		const int shift = pass * 8;
+	#pragma omp parallel for schedule(static) num_threads(slices)
+		for (int s = 0; s < slices; s++)
 		{
-			for (uint i = 0; i < node->triCount; i++)
-			{
-				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
-				IntersectTri( ray, mesh->tri[instPrim & 0xfffff /* 20 bits */], instPrim );
-			}
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
-			continue;
+			memset( digitPos[s], 0, sizeof( digitPos[s] ) );
+			for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++) digitPos[s][(key[i] >> shift) & 255]++;
 		}
-		BVHNode* child1 = &bvhNode[node->leftFirst];
-		BVHNode* child2 = &bvhNode[node->leftFirst + 1];
-#ifdef USE_SSE
-		float dist1 = IntersectAABB_SSE( ray, child1->aabbMin4, child1->aabbMax4 );
-		float dist2 = IntersectAABB_SSE( ray, child2->aabbMin4, child2->aabbMax4 );
-#else
-		float dist1 = IntersectAABB( ray, child1->aabbMin, child1->aabbMax );
-		float dist2 = IntersectAABB( ray, child2->aabbMin, child2->aabbMax );
-#endif
-		if (dist1 > dist2) { swap( dist1, dist2 ); swap( child1, child2 ); }
-		if (dist1 == 1e30f)
+		for (uint sum = 0, d = 0; d < 256; d++) for (int s = 0; s < slices; s++)
 		{
-			if (stackPtr == 0) break; else node = stack[--stackPtr];
+			uint count = digitPos[s][d];
+			digitPos[s][d] = sum, sum += count;
 		}
-		else
+	#pragma omp parallel for schedule(static) num_threads(slices)
+		for (int s = 0; s < slices; s++)
 		{
-			node = child1;
-			if (dist2 != 1e30f) stack[stackPtr++] = child2;
+			for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
+			{
+				uint pos = digitPos[s][(key[i] >> shift) & 255]++;
+				keyOut[pos] = key[i], valueOut[pos] = value[i];
+			}
 		}
+		swap( key, keyOut );
+		swap( value, valueOut );
 	}
+	delete[] digitPos;
 }
 
-void BVH::Refit()
+void BVH::PackBuildJobs()
 {
-	Timer t;
-	for (int i = nodesUsed - 1; i >= 0; i--) if (i != 1)
+	// close the gaps between the node ranges of the jobs
+	for (int i = 0; i < buildStackPtr; i++)
 	{
-		BVHNode& node = bvhNode[i];
-		if (node.isLeaf())
+		BuildJob& job = buildStack[i];
+		uint count = job.lastNode - job.firstNode, offset = job.firstNode - nodesUsed;
+		if (count == 0) continue;
+		memmove( bvhNode + nodesUsed, bvhNode + job.firstNode, count * sizeof( BVHNode ) );
+		bvhNode[job.nodeIdx].leftFirst -= offset;
+		for (uint j = nodesUsed; j < nodesUsed + count; j++)
+			if (!bvhNode[j].isLeaf()) bvhNode[j].leftFirst -= offset;
+		nodesUsed += count;
+	}
+}
+
+void BVH::CreateBuildJobs( bool morton )
+{
+	// split the largest job until all jobs are small enough or the job stack is full.
+	// the result depends only on the geometry, so every thread count yields the same tree.
+	while (buildStackPtr < 64)
+	{
+		int largest = -1;
+		uint largestCount = BUILD_JOB_SIZE;
+		for (int i = 0; i < buildStackPtr; i++)
 		{
-			// leaf node: adjust bounds to contained triangles
-			float3 dummy1, dummy2; // we don't need centroid bounds here
-			UpdateNodeBounds( i, dummy1, dummy2 );
+			uint count = bvhNode[buildStack[i].nodeIdx].triCount;
+			if (count > largestCount) largest = i, largestCount = count;
+		}
+		if (largest == -1) break;
+		BuildJob job = buildStack[largest];
+		float3 rightCentroidMin, rightCentroidMax;
+		if (morton ? !SplitNodeMorton( job.nodeIdx, nodesUsed ) :
+			!SplitNode( job.nodeIdx, nodesUsed, job.centroidMin, job.centroidMax, rightCentroidMin, rightCentroidMax ))
+		{
+			// node stays a leaf; nothing left to do for this job
+			buildStack[largest] = buildStack[--buildStackPtr];
 			continue;
 		}
-		// interior node: adjust bounds to child node bounds
-		BVHNode& leftChild = bvhNode[node.leftFirst];
-		BVHNode& rightChild = bvhNode[node.leftFirst + 1];
-		node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
-		node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+		uint leftChildIdx = bvhNode[job.nodeIdx].leftFirst;
+		BuildJob& left = buildStack[largest];
+		BuildJob& right = buildStack[buildStackPtr++];
+		left.nodeIdx = leftChildIdx, right.nodeIdx = leftChildIdx + 1;
+		if (morton) continue; // Morton splits need no bounds; the jobs calculate them
+		left.centroidMin = job.centroidMin, left.centroidMax = job.centroidMax;
+		right.centroidMin = rightCentroidMin, right.centroidMax = rightCentroidMax;
 	}
-	printf( "BVH refitted in %.2fms\n", t.elapsed() * 1000 );
+	// largest jobs first, for better load balancing
+	sort( buildStack, buildStack + buildStackPtr, [this]( const BuildJob& a, const BuildJob& b ) {
+		uint countA = bvhNode[a.nodeIdx].triCount, countB = bvhNode[b.nodeIdx].triCount;
+		return countA != countB ? countA > countB : a.nodeIdx < b.nodeIdx;
+	} );
+	// reserve node ranges: a subtree over N triangles needs at most 2N - 2 nodes besides its root
+	uint nodePtr = nodesUsed;
+	for (int i = 0; i < buildStackPtr; i++)
+		buildStack[i].firstNode = nodePtr,
+		nodePtr += bvhNode[buildStack[i].nodeIdx].triCount * 2 - 2;
 }
 
-void BVH::Build()
+void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax )
 {
-	// reset node pool
-	nodesUsed = 2;
-	memset( bvhNode, 0, mesh->triCount * 2 * sizeof( BVHNode ) );
-	// populate triangle index array
-	for (int i = 0; i < mesh->triCount; i++) triIdx[i] = i;
-	// calculate triangle centroids for partitioning
-	Tri* tri = mesh->tri;
-	for (int i = 0; i < mesh->triCount; i++)
-		mesh->tri[i].centroid = (tri[i].vertex0 + tri[i].vertex1 + tri[i].vertex2) * 0.3333f;
-	// assign all triangles to root node
-	BVHNode& root = bvhNode[0];
-	root.leftFirst = 0, root.triCount = mesh->triCount;
-	float3 centroidMin, centroidMax;
-	UpdateNodeBounds( 0, centroidMin, centroidMax );
-	// subdivide recursively
-	buildStackPtr = 0;
-	Subdivide( 0, 0, nodesUsed, centroidMin, centroidMax );
+	float3 rightCentroidMin, rightCentroidMax;
+	if (!SplitNode( nodeIdx, nodePtr, centroidMin, centroidMax, rightCentroidMin, rightCentroidMax )) return;
+	// recurse; the split already calculated the bounds of both children
+	uint leftChildIdx = bvhNode[nodeIdx].leftFirst, rightChildIdx = leftChildIdx + 1;
+	Subdivide( leftChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
+	Subdivide( rightChildIdx, depth + 1, nodePtr, rightCentroidMin, rightCentroidMax );
 }
 
-void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax )
+bool BVH::SplitNode( uint nodeIdx, uint& nodePtr, float3& centroidMin, float3& centroidMax, float3& rightCentroidMin, float3& rightCentroidMax )
 {
+	// on success, the child nodes have their bounds, centroidMin and centroidMax are
+	// replaced by the centroid bounds of the left child, and rightCentroidMin and
+	// rightCentroidMax receive those of the right child.
 	BVHNode& node = bvhNode[nodeIdx];
 	// determine split axis using SAH
 	int axis, splitPos;
-	float splitCost = FindBestSplitPlane( node, axis, splitPos, centroidMin, centroidMax );
+	aabb leftBox, rightBox;
+	float splitCost = FindBestSplitPlane( node, axis, splitPos, centroidMin, centroidMax, leftBox, rightBox );
 	// terminate recursion
+	if (splitCost >= 1e30f) return false; // all centroids coincide: axis and splitPos are not set
 	if (subdivToOnePrim)
 	{
-		if (node.triCount == 1) return;
+		if (node.triCount == 1) return false;
 	}
 	else
 	{
-		float nosplitCost = node.CalculateNodeCost();
-		if (splitCost >= nosplitCost) return;
+		// a leaf block tests up to leafBlockSize triangles at the cost of one
+		float nosplitCost = node.CalculateNodeCost( max( 1u, leafBlockSize ) );
+		if (splitCost >= nosplitCost) return false;
 	}
-	// in-place partition
+	// in-place partition, which also yields the centroid bounds of the children;
+	// large nodes are partitioned by all threads, except inside a build job, where
+	// a nested parallel region would run on a single thread
 	int i = node.leftFirst;
-	int j = i + node.triCount - 1;
-	float scale = BINS / (centroidMax[axis] - centroidMin[axis]);
-	while (i <= j)
+	aabb leftCentroids, rightCentroids;
+	if (node.triCount > PARALLEL_SPLIT_SIZE && !omp_in_parallel()) i += PartitionMT( node, axis, splitPos, centroidMin, centroidMax, leftCentroids, rightCentroids ); else
 	{
-		// use the exact calculation we used for binning to prevent rare inaccuracies
-		int binIdx = min( BINS - 1, (int)((mesh->tri[triIdx[i]].centroid[axis] - centroidMin[axis]) * scale) );
-		if (binIdx < splitPos) i++; else swap( triIdx[i], triIdx[j--] );
+		int j = i + node.triCount - 1;
+		float scale = binCount / (centroidMax[axis] - centroidMin[axis]);
+		while (i <= j)
+		{
+			// use the exact calculation we used for binning to prevent rare inaccuracies
+			int binIdx = min( (int)binCount - 1, (int)((centroid[axis][triIdx[i]] - centroidMin[axis]) * scale) );
+			if (binIdx < splitPos) leftCentroids.grow( Centroid( triIdx[i] ) ), i++;
+			else rightCentroids.grow( Centroid( triIdx[i] ) ), swap( triIdx[i], triIdx[j--] );
+		}
 	}
 	// abort split if one of the sides is empty
 	int leftCount = i - node.leftFirst;
-	if (leftCount == 0 || leftCount == node.triCount) return; // never happens for dragon mesh, nice
+	if (leftCount == 0 || leftCount == node.triCount) return false; // never happens for dragon mesh, nice
 	// create child nodes
 	int leftChildIdx = nodePtr++;
 	int rightChildIdx = nodePtr++;
@@ -232,142 +2383,212 @@ void BVH::Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMi
 	bvhNode[leftChildIdx].triCount = leftCount;
 	bvhNode[rightChildIdx].leftFirst = i;
 	bvhNode[rightChildIdx].triCount = node.triCount - leftCount;
+	bvhNode[leftChildIdx].aabbMin = leftBox.bmin, bvhNode[leftChildIdx].aabbMax = leftBox.bmax;
+	bvhNode[rightChildIdx].aabbMin = rightBox.bmin, bvhNode[rightChildIdx].aabbMax = rightBox.bmax;
 	node.leftFirst = leftChildIdx;
-	node.triCount = 0;
-	// recurse
-	UpdateNodeBounds( leftChildIdx, centroidMin, centroidMax );
-	Subdivide( leftChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
-	UpdateNodeBounds( rightChildIdx, centroidMin, centroidMax );
-	Subdivide( rightChildIdx, depth + 1, nodePtr, centroidMin, centroidMax );
+	node.SetSplitAxis( bvhNode[leftChildIdx], bvhNode[rightChildIdx] );
+	centroidMin = leftCentroids.bmin, centroidMax = leftCentroids.bmax;
+	rightCentroidMin = rightCentroids.bmin, rightCentroidMax = rightCentroids.bmax;
+	return true;
 }
 
-float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax )
+void BVH::SubdivideMorton( uint nodeIdx, uint& nodePtr, bool refine )
 {
-	float bestCost = 1e30f;
-	for (int a = 0; a < 3; a++)
+	BVHNode& node = bvhNode[nodeIdx];
+	if (refine && node.triCount <= HLBVH_CLUSTER_SIZE)
 	{
-		float boundsMin = centroidMin[a], boundsMax = centroidMax[a];
-		if (boundsMin == boundsMax) continue;
-		// populate the bins
-		float scale = BINS / (boundsMax - boundsMin);
-		float leftCountArea[BINS - 1], rightCountArea[BINS - 1];
-		int leftSum = 0, rightSum = 0;
-#ifdef USE_SSE
-		__m128 min4[BINS], max4[BINS];
-		uint count[BINS];
-		for (uint i = 0; i < BINS; i++)
-			min4[i] = _mm_set_ps1( 1e30f ),
-			max4[i] = _mm_set_ps1( -1e30f ),
-			count[i] = 0;
-		for (uint i = 0; i < node.triCount; i++)
-		{
-			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
-			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
-			count[binIdx]++;
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v0 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v0 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v1 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v1 );
-			min4[binIdx] = _mm_min_ps( min4[binIdx], triangle.v2 );
-			max4[binIdx] = _mm_max_ps( max4[binIdx], triangle.v2 );
-		}
-		// gather data for the 7 planes between the 8 bins
-		__m128 leftMin4 = _mm_set_ps1( 1e30f ), rightMin4 = leftMin4;
-		__m128 leftMax4 = _mm_set_ps1( -1e30f ), rightMax4 = leftMax4;
-		const __m128 tmp4 = _mm_setr_ps( -1, -1, -1, 1 );
-		const __m128 xyzMask4 = _mm_cmple_ps( tmp4, _mm_setzero_ps() );
-
-		for (int i = 0; i < BINS - 1; i++)
-		{
-			leftSum += count[i];
-			rightSum += count[BINS - 1 - i];
-			leftMin4 = _mm_min_ps( leftMin4, min4[i] );
-			rightMin4 = _mm_min_ps( rightMin4, min4[BINS - 2 - i] );
-			leftMax4 = _mm_max_ps( leftMax4, max4[i] );
-			rightMax4 = _mm_max_ps( rightMax4, max4[BINS - 2 - i] );
-			__m128 le = _mm_sub_ps( leftMax4, leftMin4 );
-			__m128 re = _mm_sub_ps( rightMax4, rightMin4 );
-			
-			const int yzxShuffle = 9;
-			leftCountArea[i] = leftSum * _mm_cvtss_f32( _mm_dp_ps( le, _mm_shuffle_ps( le, le, yzxShuffle ), 0x7f ) );
-			rightCountArea[BINS - 2 - i] = rightSum * _mm_cvtss_f32( _mm_dp_ps( re, _mm_shuffle_ps( re, re, yzxShuffle ), 0x7f ) );
-		}
-#else
-		struct Bin { aabb bounds; int triCount = 0; } bin[BINS];
-		for (uint i = 0; i < node.triCount; i++)
+		// bottom cluster: continue with binned SAH
+		float3 centroidMin, centroidMax;
+		UpdateNodeBounds( nodeIdx, centroidMin, centroidMax );
+		Subdivide( nodeIdx, 0, nodePtr, centroidMin, centroidMax );
+		return;
+	}
+	if (!SplitNodeMorton( nodeIdx, nodePtr ))
+	{
+		UpdateNodeBounds( nodeIdx );
+		return;
+	}
+	// recurse, then calculate the node bounds from the child bounds
+	BVHNode& leftChild = bvhNode[node.leftFirst];
+	BVHNode& rightChild = bvhNode[node.leftFirst + 1];
+	SubdivideMorton( node.leftFirst, nodePtr, refine );
+	SubdivideMorton( node.leftFirst + 1, nodePtr, refine );
+	node.aabbMin = fminf( leftChild.aabbMin, rightChild.aabbMin );
+	node.aabbMax = fmaxf( leftChild.aabbMax, rightChild.aabbMax );
+	node.SetSplitAxis( leftChild, rightChild );
+}
+
+bool BVH::SplitNodeMorton( uint nodeIdx, uint& nodePtr )
+{
+	BVHNode& node = bvhNode[nodeIdx];
+	if (node.triCount <= LBVH_LEAF_SIZE) return false;
+	// the codes in the node share a prefix; split where the next bit changes
+	uint first = node.leftFirst, last = first + node.triCount - 1, split;
+	uint64_t bit = mortonCode[first] ^ mortonCode[last];
+	if (bit == 0) split = first + (node.triCount >> 1); else // identical codes: split in the middle
+	{
+		// isolate the highest differing bit
+		bit |= bit >> 1, bit |= bit >> 2, bit |= bit >> 4;
+		bit |= bit >> 8, bit |= bit >> 16, bit |= bit >> 32;
+		bit ^= bit >> 1;
+		// binary search for the first code that has the bit set
+		uint lo = first, hi = last;
+		while (lo < hi)
 		{
-			Tri& triangle = mesh->tri[triIdx[node.leftFirst + i]];
-			int binIdx = min( BINS - 1, (int)((triangle.centroid[a] - boundsMin) * scale) );
-			bin[binIdx].triCount++;
-			bin[binIdx].bounds.grow( triangle.vertex0 );
-			bin[binIdx].bounds.grow( triangle.vertex1 );
-			bin[binIdx].bounds.grow( triangle.vertex2 );
+			uint mid = (lo + hi) >> 1;
+			if (mortonCode[mid] & bit) hi = mid; else lo = mid + 1;
 		}
-		// gather data for the 7 planes between the 8 bins
-		aabb leftBox, rightBox;
-		for (int i = 0; i < BINS - 1; i++)
+		split = lo;
+	}
+	// create child nodes
+	int leftChildIdx = nodePtr++;
+	int rightChildIdx = nodePtr++;
+	bvhNode[leftChildIdx].leftFirst = first;
+	bvhNode[leftChildIdx].triCount = split - first;
+	bvhNode[rightChildIdx].leftFirst = split;
+	bvhNode[rightChildIdx].triCount = last + 1 - split;
+	node.leftFirst = leftChildIdx;
+	node.triCount = 0;
+	return true;
+}
+
+template <int B> float BVH::BinnedSAH( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax, aabb& leftBox, aabb& rightBox )
+{
+	float scale[3];
+	for (int a = 0; a < 3; a++)
+		scale[a] = centroidMin[a] == centroidMax[a] ? 0 : B / (centroidMax[a] - centroidMin[a]);
+	const uint* idx = triIdx + node.leftFirst;
+	if (node.triCount <= PARALLEL_SPLIT_SIZE || omp_in_parallel())
+	{
+		// bin all three axes in a single pass over the triangles
+		__declspec(align(64)) SAHBins<B> bins;
+		BinTriangles( bins, BuildTris(), centroid, idx, node.triCount, centroidMin, scale );
+		float bestCost = bins.Sweep( scale, axis, splitPos, max( 1u, leafBlockSize ) );
+		if (bestCost < 1e30f) bins.ChildBoxes( axis, splitPos, leftBox, rightBox );
+		return bestCost;
+	}
+	// horizontally parallel binning: each thread bins a slice of the triangles;
+	// the per-slice bins are merged afterwards. build jobs bin serially (see SplitNode).
+	const int slices = min( 64, ThreadCount() );
+	SAHBins<B>* bins = (SAHBins<B>*)_aligned_malloc( slices * sizeof( SAHBins<B> ), 64 );
+#pragma omp parallel for schedule(static) num_threads(slices)
+	for (int s = 0; s < slices; s++)
+	{
+		const uint first = (uint)(((uint64_t)node.triCount * s) / slices);
+		const uint last = (uint)(((uint64_t)node.triCount * (s + 1)) / slices);
+		BinTriangles( bins[s], BuildTris(), centroid, idx + first, last - first, centroidMin, scale );
+	}
+	for (int s = 1; s < slices; s++) bins[0].Merge( bins[s] );
+	float bestCost = bins[0].Sweep( scale, axis, splitPos, max( 1u, leafBlockSize ) );
+	if (bestCost < 1e30f) bins[0].ChildBoxes( axis, splitPos, leftBox, rightBox );
+	_aligned_free( bins );
+	return bestCost;
+}
+
+float BVH::FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax, aabb& leftBox, aabb& rightBox )
+{
+	// dispatch to the binned SAH evaluator for the configured bin count
+	if (binCount == 32) return BinnedSAH<32>( node, axis, splitPos, centroidMin, centroidMax, leftBox, rightBox );
+	if (binCount == 16) return BinnedSAH<16>( node, axis, splitPos, centroidMin, centroidMax, leftBox, rightBox );
+	return BinnedSAH<8>( node, axis, splitPos, centroidMin, centroidMax, leftBox, rightBox );
+}
+
+uint BVH::PartitionMT( BVHNode& node, int axis, int splitPos, float3& centroidMin, float3& centroidMax, aabb& leftCentroids, aabb& rightCentroids )
+{
+	// stable parallel partition: each thread counts the left-side triangles in its slice,
+	// after which the slices scatter their indices to disjoint ranges of a scratch array.
+	// the scratch range mirrors the node's triIdx range, so concurrent jobs do not collide.
+	const int slices = min( 64, ThreadCount() );
+	const float scale = binCount / (centroidMax[axis] - centroidMin[axis]);
+	uint sliceFirst[65], leftCount[64], leftPos[64], rightPos[64];
+	aabb sliceCentroids[64][2];
+	for (int s = 0; s <= slices; s++)
+		sliceFirst[s] = node.leftFirst + (uint)(((uint64_t)node.triCount * s) / slices);
+#pragma omp parallel for schedule(static) num_threads(slices)
+	for (int s = 0; s < slices; s++)
+	{
+		uint count = 0;
+		aabb left, right;
+		for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
 		{
-			leftSum += bin[i].triCount;
-			leftBox.grow( bin[i].bounds );
-			leftCountArea[i] = leftSum * leftBox.area();
-			rightSum += bin[BINS - 1 - i].triCount;
-			rightBox.grow( bin[BINS - 1 - i].bounds );
-			rightCountArea[BINS - 2 - i] = rightSum * rightBox.area();
+			// use the exact calculation we used for binning to prevent rare inaccuracies
+			int binIdx = min( (int)binCount - 1, (int)((centroid[axis][triIdx[i]] - centroidMin[axis]) * scale) );
+			if (binIdx < splitPos) left.grow( Centroid( triIdx[i] ) ), count++; else right.grow( Centroid( triIdx[i] ) );
 		}
-#endif
-		// calculate SAH cost for the 7 planes
-		scale = (boundsMax - boundsMin) / BINS;
-		for (int i = 0; i < BINS - 1; i++)
+		leftCount[s] = count, sliceCentroids[s][0] = left, sliceCentroids[s][1] = right;
+	}
+	for (int s = 0; s < slices; s++)
+		leftCentroids.grow( sliceCentroids[s][0] ),
+		rightCentroids.grow( sliceCentroids[s][1] );
+	uint leftSum = 0, rightPtr;
+	for (int s = 0; s < slices; s++) leftPos[s] = node.leftFirst + leftSum, leftSum += leftCount[s];
+	rightPtr = node.leftFirst + leftSum;
+	for (int s = 0; s < slices; s++)
+		rightPos[s] = rightPtr,
+		rightPtr += sliceFirst[s + 1] - sliceFirst[s] - leftCount[s];
+#pragma omp parallel for schedule(static) num_threads(slices)
+	for (int s = 0; s < slices; s++)
+	{
+		for (uint i = sliceFirst[s]; i < sliceFirst[s + 1]; i++)
 		{
-			const float planeCost = leftCountArea[i] + rightCountArea[i];
-			if (planeCost < bestCost)
-				axis = a, splitPos = i + 1, bestCost = planeCost;
+			int binIdx = min( (int)binCount - 1, (int)((centroid[axis][triIdx[i]] - centroidMin[axis]) * scale) );
+			triIdxTemp[binIdx < splitPos ? leftPos[s]++ : rightPos[s]++] = triIdx[i];
 		}
 	}
-	return bestCost;
+#pragma omp parallel for schedule(static) num_threads(slices)
+	for (int s = 0; s < slices; s++)
+		memcpy( triIdx + sliceFirst[s], triIdxTemp + sliceFirst[s],
+			(sliceFirst[s + 1] - sliceFirst[s]) * sizeof( uint ) );
+	return leftSum;
 }
 
-void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax )
+void BVH::UpdateNodeBounds( uint nodeIdx )
 {
 	BVHNode& node = bvhNode[nodeIdx];
 #ifdef USE_SSE
 	__m128 min4 = _mm_set_ps1( 1e30f ), max4 = _mm_set_ps1( -1e30f );
-	__m128 cmin4 = _mm_set_ps1( 1e30f ), cmax4 = _mm_set_ps1( -1e30f );
 	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
 	{
-		Tri& leafTri = mesh->tri[triIdx[first + i]];
-		min4 = _mm_min_ps( min4, leafTri.v0 ), max4 = _mm_max_ps( max4, leafTri.v0 );
-		min4 = _mm_min_ps( min4, leafTri.v1 ), max4 = _mm_max_ps( max4, leafTri.v1 );
-		min4 = _mm_min_ps( min4, leafTri.v2 ), max4 = _mm_max_ps( max4, leafTri.v2 );
-		cmin4 = _mm_min_ps( cmin4, leafTri.centroid4 );
-		cmax4 = _mm_max_ps( cmax4, leafTri.centroid4 );
+		const Tri& triangle = BuildTris()[triIdx[first + i]];
+		min4 = _mm_min_ps( min4, triangle.v0 ), max4 = _mm_max_ps( max4, triangle.v0 );
+		min4 = _mm_min_ps( min4, triangle.v1 ), max4 = _mm_max_ps( max4, triangle.v1 );
+		min4 = _mm_min_ps( min4, triangle.v2 ), max4 = _mm_max_ps( max4, triangle.v2 );
 	}
 	__m128 mask4 = _mm_cmpeq_ps( _mm_setzero_ps(), _mm_set_ps( 1, 0, 0, 0 ) );
 	node.aabbMin4 = _mm_blendv_ps( node.aabbMin4, min4, mask4 );
 	node.aabbMax4 = _mm_blendv_ps( node.aabbMax4, max4, mask4 );
-	centroidMin = *(float3*)&cmin4;
-	centroidMax = *(float3*)&cmax4;
 #else
 	node.aabbMin = float3( 1e30f );
 	node.aabbMax = float3( -1e30f );
-	centroidMin = float3( 1e30f );
-	centroidMax = float3( -1e30f );
 	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
 	{
 		uint leafTriIdx = triIdx[first + i];
-		Tri& leafTri = mesh->tri[leafTriIdx];
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex0 );
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex1 );
-		node.aabbMin = fminf( node.aabbMin, leafTri.vertex2 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex0 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex1 );
-		node.aabbMax = fmaxf( node.aabbMax, leafTri.vertex2 );
-		centroidMin = fminf( centroidMin, leafTri.centroid );
-		centroidMax = fmaxf( centroidMax, leafTri.centroid );
+		const Tri& triangle = BuildTris()[leafTriIdx];
+		node.aabbMin = fminf( node.aabbMin, triangle.vertex0 );
+		node.aabbMin = fminf( node.aabbMin, triangle.vertex1 );
+		node.aabbMin = fminf( node.aabbMin, triangle.vertex2 );
+		node.aabbMax = fmaxf( node.aabbMax, triangle.vertex0 );
+		node.aabbMax = fmaxf( node.aabbMax, triangle.vertex1 );
+		node.aabbMax = fmaxf( node.aabbMax, triangle.vertex2 );
 	}
 #endif
 }
 
+void BVH::UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax )
+{
+	// node bounds plus centroid bounds, for building; only the builders keep centroids
+	UpdateNodeBounds( nodeIdx );
+	const BVHNode& node = bvhNode[nodeIdx];
+	centroidMin = float3( 1e30f );
+	centroidMax = float3( -1e30f );
+	for (uint first = node.leftFirst, i = 0; i < node.triCount; i++)
+	{
+		const float3 c = Centroid( triIdx[first + i] );
+		centroidMin = fminf( centroidMin, c );
+		centroidMax = fmaxf( centroidMax, c );
+	}
+}
+
 // BVHInstance implementation
 
 void BVHInstance::SetTransform( mat4& T )
@@ -385,16 +2606,44 @@ void BVHInstance::SetTransform( mat4& T )
 
 void BVHInstance::Intersect( Ray& ray )
 {
-	// backup ray and transform original
-	Ray backupRay = ray;
-	ray.O = TransformPosition( ray.O, invTransform );
-	ray.D = TransformVector( ray.D, invTransform );
-	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
-	// trace ray through BVH
-	bvh->Intersect( ray, idx );
-	// restore ray origin and direction
-	backupRay.hit = ray.hit;
-	ray = backupRay;
+	// trace a transformed ray through the BVH; only the intersection record goes back,
+	// so the world-space ray is never copied or restored
+	Ray localRay;
+	localRay.O = TransformPosition( ray.O, invTransform );
+	localRay.D = TransformVector( ray.D, invTransform );
+	localRay.rD = float3( 1 / localRay.D.x, 1 / localRay.D.y, 1 / localRay.D.z );
+	localRay.hit = ray.hit;
+	bvh->Intersect( localRay, idx );
+	ray.hit = localRay.hit;
+}
+
+template <int N> void BVHInstance::Intersect( RayPacket<N>& packet, uint laneMask )
+{
+	// transform a copy of the packet, and copy the intersection records back
+	RayPacket<N> local;
+	for (int i = 0; i < N; i++)
+		local.Set( i, TransformPosition( float3( packet.O[0][i], packet.O[1][i], packet.O[2][i] ), invTransform ),
+			TransformVector( float3( packet.D[0][i], packet.D[1][i], packet.D[2][i] ), invTransform ) );
+	for (int g = 0; g < N / 4; g++)
+		local.t4[g] = packet.t4[g], local.u4[g] = packet.u4[g],
+		local.v4[g] = packet.v4[g], local.instPrim4[g] = packet.instPrim4[g];
+	bvh->Intersect( local, idx, laneMask );
+	for (int g = 0; g < N / 4; g++)
+		packet.t4[g] = local.t4[g], packet.u4[g] = local.u4[g],
+		packet.v4[g] = local.v4[g], packet.instPrim4[g] = local.instPrim4[g];
+}
+template void BVHInstance::Intersect( RayPacket4& packet, uint laneMask );
+template void BVHInstance::Intersect( RayPacket8& packet, uint laneMask );
+template void BVHInstance::Intersect( RayPacket16& packet, uint laneMask );
+
+bool BVHInstance::IsOccluded( const Ray& ray, float tmax )
+{
+	// the transform is affine and D is not renormalized, so tmax carries over unchanged
+	Ray localRay;
+	localRay.O = TransformPosition( ray.O, invTransform );
+	localRay.D = TransformVector( ray.D, invTransform );
+	localRay.rD = float3( 1 / localRay.D.x, 1 / localRay.D.y, 1 / localRay.D.z );
+	return bvh->IsOccluded( localRay, tmax );
 }
 
 // TLAS implementation
@@ -447,6 +2696,7 @@ void TLAS::Build()
 	int A = 0, B = FindBestMatch( nodeIndices, A );
 	// copy last remaining node to the root node
 	tlasNode[0] = tlasNode[nodeIdx[A]];
+	if (width > 2) Collapse();
 }
 
 void TLAS::SortAndSplit( uint first, uint last, uint level )
@@ -540,6 +2790,7 @@ void TLAS::BuildQuick()
 	m.bvh->Build();
 	// copy the BVH to a TLAS
 	memcpy( tlasNode, m.bvh->bvhNode, m.bvh->nodesUsed * sizeof( BVHNode ) );
+	nodesUsed = m.bvh->nodesUsed;
 	for (uint i = 0; i < m.bvh->nodesUsed; i++) if (i != 1)
 	{
 		const BVHNode& n = m.bvh->bvhNode[i];
@@ -549,12 +2800,55 @@ void TLAS::BuildQuick()
 		else
 			tlasNode[i].leftRight = n.leftFirst + ((n.leftFirst + 1) << 16);
 	}
+	if (width > 2) Collapse();
+}
+
+void TLAS::Relayout( NodeLayout layout )
+{
+	// as BVH::Relayout; sibling pairs become adjacent, even after Build
+	if (!tlasNodeTemp) tlasNodeTemp = (TLASNode*)_aligned_malloc( sizeof( TLASNode ) * 2 * (blasCount + 64), 64 );
+	nodesUsed = CopyNodesInOrder( tlasNode, tlasNodeTemp, nodesUsed, layout );
+	// copy back rather than swap: the kD-trees of BuildQuick point into tlasNode
+	memcpy( tlasNode, tlasNodeTemp, nodesUsed * sizeof( TLASNode ) );
+}
+
+void TLAS::SetWidth( uint w, bool compress )
+{
+	// 2, 4 or 8 (with AVX2), optionally compressed; takes effect when the TLAS is built
+	width = w >= 8 && CPUCaps::HW_AVX2 ? 8 : w >= 4 ? 4 : 2;
+	compressed = compress && width == 8;
+}
+
+void TLAS::Collapse()
+{
+	const uint maxNodes = nodesUsed / 2 + 2;
+	wideNodesUsed = 0;
+	if (compressed)
+	{
+		// leaves hold a single BLAS, so a count byte always suffices
+		if (blasCount > widePrimCount) delete[] widePrim, widePrim = new uint[widePrimCount = blasCount];
+		uint primsUsed = 0;
+		wideNodesUsed = 1;
+		CollapseNodeCompressed( tlasNode, 0, 0, (BVH8CNode*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH8CNode ) ), wideNodesUsed, 0, widePrim, primsUsed );
+		return;
+	}
+	if (width == 8) CollapseNode<8>( tlasNode, 0, (BVH8Node*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH8Node ) ), wideNodesUsed );
+	else CollapseNode<4>( tlasNode, 0, (BVH4Node*)ReserveWide( wideNode, wideCapacity, maxNodes * sizeof( BVH4Node ) ), wideNodesUsed );
 }
 
 void TLAS::Intersect( Ray& ray )
 {
 	// calculate reciprocal ray directions for faster AABB intersection
 	ray.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	if (width > 2)
+	{
+		// traverse the wide copy of the TLAS
+		auto intersectLeaf = [&]( uint first, uint ) { blas[compressed ? widePrim[first] : first].Intersect( ray ); };
+		if (compressed) IntersectWide<8>( ray, (const BVH8CNode*)wideNode, intersectLeaf );
+		else if (width == 8) IntersectWide<8>( ray, (const BVH8Node*)wideNode, intersectLeaf );
+		else IntersectWide<4>( ray, (const BVH4Node*)wideNode, intersectLeaf );
+		return;
+	}
 	// use a local stack instead of a recursive function
 	TLASNode* node = &tlasNode[0], * stack[64];
 	uint stackPtr = 0;
@@ -589,4 +2883,114 @@ void TLAS::Intersect( Ray& ray )
 	}
 }
 
+template <int N> void TLAS::Intersect( RayPacket<N>& packet )
+{
+	// packet traversal of the binary TLAS; each BLAS is entered with the rays that reach it
+	SetReciprocalDirections( packet );
+	IntersectPacketBinary( packet, tlasNode, (1 << N) - 1, [&]( uint blasIdx, uint, uint laneMask ) {
+		blas[blasIdx].Intersect( packet, laneMask );
+	} );
+}
+template void TLAS::Intersect( RayPacket4& packet );
+template void TLAS::Intersect( RayPacket8& packet );
+template void TLAS::Intersect( RayPacket16& packet );
+
+
+bool TLAS::IsOccluded( const Ray& ray, float tmax )
+{
+	// any-hit query for shadow rays: true if anything is hit closer than tmax
+	Ray shadowRay = ray;
+	shadowRay.rD = float3( 1 / ray.D.x, 1 / ray.D.y, 1 / ray.D.z );
+	shadowRay.hit.t = tmax;
+	if (width == 2) return IsOccludedBinary( shadowRay, tlasNode, [&]( uint blasIdx, uint ) { return blas[blasIdx].IsOccluded( shadowRay, tmax ); } );
+	auto occludedLeaf = [&]( uint first, uint ) { return blas[compressed ? widePrim[first] : first].IsOccluded( shadowRay, tmax ); };
+	if (compressed) return IsOccludedWide<8>( shadowRay, (const BVH8CNode*)wideNode, occludedLeaf );
+	if (width == 8) return IsOccludedWide<8>( shadowRay, (const BVH8Node*)wideNode, occludedLeaf );
+	return IsOccludedWide<4>( shadowRay, (const BVH4Node*)wideNode, occludedLeaf );
+}
+
+uint TLAS::IsOccluded( const Ray* rays, const float* tmax, bool* occluded, uint count )
+{
+	// batched any-hit queries, e.g. one shadow ray per pixel; returns the number of occluded rays.
+	// scheduled like IntersectBatch: chunks of consecutive rays, on all cores.
+	if (count == 0) return 0;
+	struct Batch { TLAS* tlas; const Ray* rays; const float* tmax; bool* occluded; uint count, chunkSize; };
+	Batch batch = { this, rays, tmax, occluded, count, max( 1u, batchChunkSize ) };
+	RunBatch( (count + batch.chunkSize - 1) / batch.chunkSize, []( uint chunk, void* context ) {
+		const Batch& b = *(const Batch*)context;
+		const uint first = chunk * b.chunkSize, last = min( b.count, first + b.chunkSize );
+		for (uint i = first; i < last; i++) b.occluded[i] = b.tlas->IsOccluded( b.rays[i], b.tmax[i] );
+	}, &batch );
+	uint occludedCount = 0;
+	for (uint i = 0; i < count; i++) occludedCount += occluded[i];
+	return occludedCount;
+}
+
+void TLAS::RunBatch( uint chunkCount, void (*job)( uint chunk, void* context ), void* context )
+{
+	// run the chunks of a batch query on batchScheduler, or on OpenMP threads
+	if (batchScheduler) { batchScheduler( chunkCount, job, context ); return; }
+	const int threads = batchThreads > 0 ? batchThreads : (int)thread::hardware_concurrency();
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+	for (int i = 0; i < (int)chunkCount; i++) job( i, context );
+}
+
+void TLAS::IntersectBatch( const Ray* rays, Intersection* hits, size_t count )
+{
+	// trace a batch of independent rays on all cores. hits[i] receives the nearest intersection
+	// of rays[i], starting from rays[i].hit. the rays are handed out in chunks of consecutive
+	// rays, so that rays that visit the same nodes are traced by the same thread, back to back.
+	if (count == 0) return;
+	uint* order = 0;
+	if (batchSort)
+	{
+		// sort by octant first, so a chunk runs one traversal kernel, then by a Morton code
+		// of the origin in the bounds of the batch, then by one of the direction
+		aabb bounds;
+		for (size_t i = 0; i < count; i++) bounds.grow( rays[i].O );
+		const float3 extent = bounds.bmax - bounds.bmin;
+		const float3 scale( extent.x > 0 ? 1023.99f / extent.x : 0, extent.y > 0 ? 1023.99f / extent.y : 0, extent.z > 0 ? 1023.99f / extent.z : 0 );
+		struct SortKey { uint64_t key; uint idx; };
+		struct KeyBatch { const Ray* rays; SortKey* key; float3 bmin, scale; size_t count; uint chunkSize; };
+		KeyBatch keyBatch = { rays, new SortKey[count], bounds.bmin, scale, count, max( 1u, batchChunkSize ) };
+		auto keyJob = []( uint chunk, void* context ) {
+			// the keys are calculated on the same threads as the queries
+			const KeyBatch& b = *(const KeyBatch*)context;
+			const size_t first = (size_t)chunk * b.chunkSize, last = min( b.count, first + b.chunkSize );
+			for (size_t i = first; i < last; i++)
+			{
+				// D need not be normalized; fminf and fmaxf also map the NaNs of a zero D into range
+				const Ray& ray = b.rays[i];
+				const float3 D = fminf( fmaxf( normalize( ray.D ), float3( -1 ) ), float3( 1 ) );
+				const float3 o = (ray.O - b.bmin) * b.scale, d = (D + 1) * 255.99f;
+				const uint64_t octant = (ray.D.x < 0 ? 1 : 0) + (ray.D.y < 0 ? 2 : 0) + (ray.D.z < 0 ? 4 : 0);
+				const uint64_t origin = MortonSpread( (uint)o.x ) + (MortonSpread( (uint)o.y ) << 1) + (MortonSpread( (uint)o.z ) << 2);
+				const uint64_t direction = MortonSpread( (uint)d.x ) + (MortonSpread( (uint)d.y ) << 1) + (MortonSpread( (uint)d.z ) << 2);
+				b.key[i].key = (octant << 57) + (origin << 27) + direction, b.key[i].idx = (uint)i;
+			}
+		};
+		RunBatch( (uint)((count + keyBatch.chunkSize - 1) / keyBatch.chunkSize), keyJob, &keyBatch );
+		SortKey* key = keyBatch.key;
+		sort( key, key + count, []( const SortKey& a, const SortKey& b ) { return a.key < b.key; } );
+		order = new uint[count];
+		for (size_t i = 0; i < count; i++) order[i] = key[i].idx;
+		delete[] key;
+	}
+	struct Batch { TLAS* tlas; const Ray* rays; Intersection* hits; const uint* order; size_t count; uint chunkSize; };
+	Batch batch = { this, rays, hits, order, count, max( 1u, batchChunkSize ) };
+	auto job = []( uint chunk, void* context ) {
+		const Batch& b = *(const Batch*)context;
+		const size_t first = (size_t)chunk * b.chunkSize, last = min( b.count, first + b.chunkSize );
+		for (size_t i = first; i < last; i++)
+		{
+			const size_t idx = b.order ? b.order[i] : i;
+			Ray ray = b.rays[idx];
+			b.tlas->Intersect( ray );
+			b.hits[idx] = ray.hit;
+		}
+	};
+	RunBatch( (uint)((count + batch.chunkSize - 1) / batch.chunkSize), job, &batch );
+	delete[] order;
+}
+
 // EOF
@@ -3,32 +3,61 @@
 // enable the use of SSE in the AABB intersection function
 #define USE_SSE
 
-// bin count for binned BVH building
+// default bin count for binned BVH building; 8, 16 and 32 are supported
 #define BINS 8
 
+// threaded BVH building: subtrees with more triangles than this become separate jobs
+#define BUILD_JOB_SIZE 256
+
+// nodes with more triangles than this are binned and partitioned by all threads
+#define PARALLEL_SPLIT_SIZE 65536
+// linear BVH building: nodes with this many triangles or fewer become leaves
+#define LBVH_LEAF_SIZE 4
+// hybrid BVH building: clusters of this many triangles or fewer are built with binned SAH
+#define HLBVH_CLUSTER_SIZE 1024
+// bottom-up BVH building: clusters search for a nearest neighbor this far up and down the Morton order
+#define PLOC_RADIUS 16
+// spatial split BVH building: bins per axis for the spatial split search
+#define SBVH_BINS 32
+// triangle pre-splitting: bisect only if the halves save this fraction of the box area
+#define PRESPLIT_MIN_GAIN 0.3f
+// treelet optimization: number of subtrees in a treelet; at most 8
+#define TREELET_SIZE 7
+// node relayout: levels of sibling pairs that LAYOUT_BFS_TOP stores breadth-first
+#define LAYOUT_BFS_LEVELS 7
+
 namespace Tmpl8
 {
 
-// minimalist triangle struct
-__declspec(align(64)) struct Tri
+// minimalist triangle struct; the BVH builder keeps the centroids separately
+__declspec(align(16)) struct Tri
 {
 	// union each float3 with a 16-byte __m128 for faster BVH construction
 	union { float3 vertex0; __m128 v0; };
 	union { float3 vertex1; __m128 v1; };
-	union { float3 vertex2; __m128 v2; };
-	union { float3 centroid; __m128 centroid4; }; // total size: 64 bytes
+	union { float3 vertex2; __m128 v2; }; // total size: 48 bytes
 };
 
 // additional triangle data, for texturing and shading
 struct TriEx { float2 uv0, uv1, uv2; float3 N0, N1, N2; };
 
+// precomputed triangle: the affine transform that maps the triangle to the unit triangle
+// (0,0,0), (1,0,0), (0,1,0) in the z = 0 plane. a ray test becomes a plane intersection
+// and two dot products, which yield the barycentrics directly.
+struct TriAccel
+{
+	float3 U; float du;		// u = dot( U, P ) + du
+	float3 V; float dv;		// v = dot( V, P ) + dv
+	float3 W; float dw;		// distance to the plane, in units of the normal; total size: 48 bytes
+};
+
 // minimalist AABB struct with grow functionality
 struct aabb
 {
 	float3 bmin = 1e30f, bmax = -1e30f;
 	void grow( float3 p ) { bmin = fminf( bmin, p ); bmax = fmaxf( bmax, p ); }
-	void grow( aabb& b ) { if (b.bmin.x != 1e30f) { grow( b.bmin ); grow( b.bmax ); } }
-	float area()
+	void grow( const aabb& b ) { if (b.bmin.x != 1e30f) { grow( b.bmin ); grow( b.bmax ); } }
+	float area() const
 	{
 		float3 e = bmax - bmin; // box extent
 		return e.x * e.y + e.y * e.z + e.z * e.x;
@@ -53,19 +82,110 @@ __declspec(align(64)) struct Ray
 	Intersection hit; // total ray size: 64 bytes
 };
 
-// 32-byte BVH node struct
+// node orders for BVH::Relayout and TLAS::Relayout; sibling pairs stay adjacent in all of them
+enum NodeLayout
+{
+	LAYOUT_DFS,		// depth-first: each pair is followed by the subtree of its first node
+	LAYOUT_BFS_TOP,	// breadth-first for the top LAYOUT_BFS_LEVELS levels, depth-first below
+	LAYOUT_VEB		// van Emde Boas: top half of the tree first, then each bottom tree, recursively
+};
+
+// packet of N coherent rays in SoA layout, traced together; N is 4, 8 or 16
+template <int N> __declspec(align(64)) struct RayPacket
+{
+	void Set( int i, const float3& origin, const float3& direction )
+	{
+		O[0][i] = origin.x, O[1][i] = origin.y, O[2][i] = origin.z;
+		D[0][i] = direction.x, D[1][i] = direction.y, D[2][i] = direction.z;
+		t[i] = 1e30f; // 1e30f denotes 'no hit'
+	}
+	void Get( int i, Ray& ray ) const
+	{
+		ray.O = float3( O[0][i], O[1][i], O[2][i] ), ray.D = float3( D[0][i], D[1][i], D[2][i] );
+		ray.hit.t = t[i], ray.hit.u = u[i], ray.hit.v = v[i], ray.hit.instPrim = instPrim[i];
+	}
+	union { float O[3][N]; __m128 O4[3][N / 4]; };		// origins, one row per axis
+	union { float D[3][N]; __m128 D4[3][N / 4]; };		// directions
+	union { float rD[3][N]; __m128 rD4[3][N / 4]; };	// reciprocal directions; set by Intersect
+	union { float t[N]; __m128 t4[N / 4]; };			// the intersection records, per field
+	union { float u[N]; __m128 u4[N / 4]; };
+	union { float v[N]; __m128 v4[N / 4]; };
+	union { uint instPrim[N]; __m128 instPrim4[N / 4]; };
+};
+typedef RayPacket<4> RayPacket4;
+typedef RayPacket<8> RayPacket8;
+typedef RayPacket<16> RayPacket16;
+
+// 32-byte BVH node struct. interior nodes have no triangles; instead, bits 29 and 30 of
+// triCount hold their split axis, and bit 31 is set if the right child is on the min side.
 struct BVHNode
 {
 	union { struct { float3 aabbMin; uint leftFirst; }; __m128 aabbMin4; };
 	union { struct { float3 aabbMax; uint triCount; }; __m128 aabbMax4; };
-	bool isLeaf() const { return triCount > 0; } // empty BVH leaves do not exist
-	float CalculateNodeCost()
+	bool isLeaf() const { return (triCount & 0x1fffffff) > 0; } // empty BVH leaves do not exist
+	template <class N> void SetSplitAxis( const N& left, const N& right )
+	{
+		// the axis along which the child boxes are farthest apart; derived from the boxes,
+		// so it holds for every builder and optimizer. N: any node type with a box
+		const float3 d = (right.aabbMin + right.aabbMax) - (left.aabbMin + left.aabbMax);
+		const float3 a( fabs( d.x ), fabs( d.y ), fabs( d.z ) );
+		const uint axis = a.x >= a.y ? (a.x >= a.z ? 0 : 2) : (a.y >= a.z ? 1 : 2);
+		triCount = (axis + (d.cell[axis] < 0 ? 4 : 0)) << 29;
+	}
+	float CalculateNodeCost( const uint blockSize = 1 )
 	{
 		float3 e = aabbMax - aabbMin; // extent of the node
-		return (e.x * e.y + e.y * e.z + e.z * e.x) * triCount;
+		return (e.x * e.y + e.y * e.z + e.z * e.x) * ((triCount + blockSize - 1) / blockSize);
 	}
 };
 
+// 4-wide BVH node: the child bounds are stored in SoA layout, so that a single set
+// of SSE instructions tests the ray against all four children
+__declspec(align(64)) struct BVH4Node
+{
+	__m128 bounds[6];	// min x, y, z and max x, y, z of the four children
+	uint child[4];		// interior child: node index; leaf child: first triIdx entry
+	uint triCount[4];	// 0 for interior children; total size: 128 bytes
+};
+
+// 8-wide BVH node, same layout with AVX registers; traversed with AVX2
+__declspec(align(64)) struct BVH8Node
+{
+	__m256 bounds[6];	// min x, y, z and max x, y, z of the eight children
+	uint child[8];		// interior child: node index; leaf child: first triIdx entry
+	uint triCount[8];	// 0 for interior children; total size: 256 bytes
+};
+
+// compressed 8-wide BVH node: the child bounds are 8-bit coordinates on a grid that spans
+// the node, with a power-of-two spacing per axis. the interior children of a node are
+// consecutive, as are the primitives of its leaf children, so small offsets locate them.
+__declspec(align(32)) struct BVH8CNode
+{
+	float3 origin;			// grid origin: the minimum of the child bounds
+	uchar exponent[3];		// grid spacing per axis, as a float exponent: 2^(exponent - 127)
+	uchar dummy;
+	uint childBase;			// first interior child node
+	uint primBase;			// first widePrim entry of the leaf children
+	ushort offset[8];		// interior child: node index - childBase; leaf child: widePrim index - primBase
+	uchar count[8];			// 0 for interior children
+	uchar bounds[6][8];		// min x, y, z and max x, y, z of the eight children; total size: 96 bytes
+};
+
+// SoA block of up to four leaf triangles, tested against a ray with SSE; unused lanes have
+// zero edges, so they never hit. see BVH::SetLeafBlocks
+__declspec(align(16)) struct TriBlock4
+{
+	__m128 v0[3], e1[3], e2[3];	// vertex 0 and both edges, one row per axis
+	uint prim[4];				// triangle indices; total size: 160 bytes
+};
+
+// the same for eight triangles, tested with AVX
+__declspec(align(32)) struct TriBlock8
+{
+	__m256 v0[3], e1[3], e2[3];
+	uint prim[8];				// total size: 320 bytes
+};
+
 // bounding volume hierarchy, to be used as BLAS
 __declspec(align(64)) class BVH
 {
@@ -73,23 +193,115 @@ __declspec(align(64)) class BVH
 	{
 		uint nodeIdx;
 		float3 centroidMin, centroidMax;
+		uint firstNode, lastNode; // node range reserved for the subtree of this job
+	};
+	// pre-split reference: part of triangle prim, as the barycentric coordinates (u, v) of its
+	// corners, so that it follows the vertices when the mesh animates. see PreSplit
+	struct SplitRef
+	{
+		float2 corner[3];
+		uint prim;
 	};
 public:
 	BVH() = default;
 	BVH( class Mesh* mesh );
 	void Build();
+	void BuildLBVH();
+	void BuildHLBVH();
+	void BuildPLOC();
+	void BuildSBVH();
+	void PreSplit( const float budget );
 	void Refit();
+	void OptimizeTreelets( uint rounds = 1 );
+	void OptimizeReinsertion( float budget );
+	void ReorderTriangles();
+	size_t Compact(); // returns the number of bytes saved
+	void Relayout( NodeLayout order );
+	float CacheMisses( const Ray* rays, uint rayCount, uint cacheSize = 32768 );
+	void SetWidth( uint w, bool compress = false );
+	void SetLeafBlocks( uint size );
 	void Intersect( Ray& ray, uint instanceIdx );
+	template <int N> void Intersect( RayPacket<N>& packet, uint instanceIdx, uint laneMask = 0xffff );
+	bool IsOccluded( const Ray& ray, float tmax );
+	void PrecomputeTriangles();
 private:
 	void Subdivide( uint nodeIdx, uint depth, uint& nodePtr, float3& centroidMin, float3& centroidMax );
+	bool SplitNode( uint nodeIdx, uint& nodePtr, float3& centroidMin, float3& centroidMax, float3& rightCentroidMin, float3& rightCentroidMax );
+	void BuildMorton( bool refine );
+	void SubdivideMorton( uint nodeIdx, uint& nodePtr, bool refine );
+	bool SplitNodeMorton( uint nodeIdx, uint& nodePtr );
+	void CreateBuildJobs( bool morton );
+	void PackBuildJobs();
+	void RestructureTreelet( uint rootIdx );
+	uint Reinsert( uint nodeIdx, uint* parent );
+	void RefitPath( uint nodeIdx, const uint* parent );
+	float NodeArea( const BVHNode& node ) const
+	{
+		const float3 e = node.aabbMax - node.aabbMin;
+		return e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+	void RenumberNodes();
+	void Collapse();
+	void BuildLeafBlocks();
+	template <int OCTANT> void IntersectOctant( Ray& ray, uint instanceIdx );
+	void IntersectLeaf( Ray& ray, const BVHNode& node, uint instanceIdx );
+	void IntersectLeafBlocks( Ray& ray, uint first, uint count, uint instanceIdx );
+	void FinishBuild();
+	void SplitRefCorners( const SplitRef& ref, float3* corner ) const;
+	float BisectGain( const SplitRef& ref, int& edge ) const;
+	void UpdateSplitRefs();
+	const Tri* BuildTris() const;
+	void Reserve( uint refCount );
+	void ResetNodes( float3& centroidMin, float3& centroidMax, const bool useSplitRefs = true );
+	void SortMorton( const float3& centroidMin, const float3& centroidMax );
+	void UpdateNodeBounds( uint nodeIdx );
 	void UpdateNodeBounds( uint nodeIdx, float3& centroidMin, float3& centroidMax );
-	float FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax );
+	float FindBestSplitPlane( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax, aabb& leftBox, aabb& rightBox );
+	template <int B> float BinnedSAH( BVHNode& node, int& axis, int& splitPos, float3& centroidMin, float3& centroidMax, aabb& leftBox, aabb& rightBox );
+	uint PartitionMT( BVHNode& node, int axis, int splitPos, float3& centroidMin, float3& centroidMax, aabb& leftCentroids, aabb& rightCentroids );
+	int ThreadCount() const { return buildThreads > 0 ? buildThreads : (int)thread::hardware_concurrency(); }
+	float3 Centroid( uint idx ) const { return float3( centroid[0][idx], centroid[1][idx], centroid[2][idx] ); }
 	class Mesh* mesh = 0;
+	float* centroid[3] = {}; // triangle centroids for building, one array per axis
+	uint* triIdxTemp = 0; // scratch space for parallel partitioning
+	uint64_t* mortonCode = 0, * mortonTemp = 0; // sorted Morton codes, for linear BVH building
+	uint refCapacity = 0; // triangle references that bvhNode and triIdx can hold
+	BVHNode* bvhNodeTemp = 0; // scratch space for reordering nodes
+	size_t wideCapacity = 0; // bytes allocated for wideNode
+	uint widePrimCount = 0; // entries allocated for widePrim
+	uint triAccelCount = 0; // entries allocated for triAccel
+	size_t leafBlockCapacity = 0; // bytes allocated for leafBlock
+	uint leafBlockIdxCount = 0; // entries allocated for leafBlockIdx
+	uint leafTriCapacity = 0; // entries allocated for leafTri and leafTriEx
+	SplitRef* splitRef = 0; // pre-split triangle references; see PreSplit
+	uint splitRefCount = 0;
+	Tri* refTri = 0; // per reference: proxy triangle with the bounds of the reference
+	uint refTriCapacity = 0; // entries allocated for refTri
+	bool refBuild = false; // the current build reads refTri instead of mesh->tri
 public:
 	uint* triIdx = 0;
+	uint idxCount = 0; // exceeds the triangle count if BuildSBVH duplicated references
 	uint nodesUsed;
 	BVHNode* bvhNode = 0;
+	uint width = 2; // 2: binary traversal; 4, 8: traverse the wide copy of the tree. see SetWidth
+	void* wideNode = 0; // BVH4Node, BVH8Node or BVH8CNode array, depending on width and compressed
+	uint wideNodesUsed = 0;
+	bool compressed = false; // width 8 only; falls back to BVH8Node if a leaf exceeds 255 triangles
+	uint* widePrim = 0; // compressed nodes: triangle indices, in the order of the wide leaves
+	TriAccel* triAccel = 0; // per-triangle transforms, parallel to mesh->tri; see PrecomputeTriangles
+	uint leafBlockSize = 0; // 0: triangles are tested one by one; 4, 8: SoA leaf blocks. see SetLeafBlocks
+	void* leafBlock = 0; // TriBlock4 or TriBlock8 array; a leaf uses consecutive blocks
+	uint* leafBlockIdx = 0; // first block of a leaf, indexed by its first triIdx entry
 	bool subdivToOnePrim = false; // for TLAS experiment
+	uint buildThreads = 0; // 0: one thread per logical core
+	uint binCount = BINS; // 8, 16 or 32; more bins trade build time for tree quality
+	float spatialSplitBudget = 0.3f; // BuildSBVH: duplicate references, as a fraction of the triangle count
+	float spatialSplitAlpha = 1e-5f; // BuildSBVH: child overlap, relative to the root area, that triggers a spatial split search
+	bool morton63 = false; // 63-bit Morton codes for BuildLBVH; 30-bit codes collide on large meshes
+	bool leafOrder = false; // set by ReorderTriangles, cleared by builds: traversal reads leafTri
+	Tri* leafTri = 0; // ReorderTriangles: copy of the triangles in the order of triIdx
+	TriEx* leafTriEx = 0; // same, for mesh->triEx; for the GPU, whose hits return the leaf position
+	NodeLayout layout = LAYOUT_DFS; // node order; set by Relayout, kept by the optimizers and Compact
 	BuildJob buildStack[64];
 	int buildStackPtr;
 };
@@ -118,6 +330,8 @@ public:
 	void SetTransform( mat4& transform );
 	mat4& GetTransform() { return transform; }
 	void Intersect( Ray& ray );
+	template <int N> void Intersect( RayPacket<N>& packet, uint laneMask = 0xffff );
+	bool IsOccluded( const Ray& ray, float tmax );
 private:
 	mat4 transform;
 	mat4 invTransform; // inverse transform
@@ -151,6 +365,10 @@ struct TLASNode
 // include kD-tree logic for fast agglomerative clustering
 #include "kdtree.h"
 
+// runs job( chunk, context ) once for each chunk in [0, chunkCount), in any order and on any
+// thread; lets the TLAS batch queries use the thread pool of the application
+typedef void (*BatchScheduler)( uint chunkCount, void (*job)( uint chunk, void* context ), void* context );
+
 // top-level BVH class
 __declspec(align(64)) class TLAS
 {
@@ -158,11 +376,31 @@ public:
 	TLAS() = default;
 	TLAS( BVHInstance* bvhList, int N );
 	void Build();
+	void Relayout( NodeLayout layout );
+	void SetWidth( uint w, bool compress = false );
 	void Intersect( Ray& ray );
+	template <int N> void Intersect( RayPacket<N>& packet );
+	bool IsOccluded( const Ray& ray, float tmax );
+	uint IsOccluded( const Ray* rays, const float* tmax, bool* occluded, uint count );
+	void IntersectBatch( const Ray* rays, Intersection* hits, size_t count );
 private:
 	int FindBestMatch( int N, int A );
+	void Collapse();
+	void RunBatch( uint chunkCount, void (*job)( uint chunk, void* context ), void* context );
+	size_t wideCapacity = 0;
+	uint widePrimCount = 0;
 public:
 	TLASNode* tlasNode = 0;
+	TLASNode* tlasNodeTemp = 0; // scratch space for Relayout
+	uint width = 2; // as for BVH; the wide copy is made by Build and BuildQuick
+	void* wideNode = 0;
+	uint wideNodesUsed = 0;
+	bool compressed = false;
+	uint* widePrim = 0; // compressed nodes: BLAS indices, in the order of the wide leaves
+	uint batchThreads = 0; // batch queries: 0: one thread per logical core
+	uint batchChunkSize = 256; // batch queries: rays per scheduled chunk
+	bool batchSort = false; // IntersectBatch: trace in order of octant, origin and direction
+	BatchScheduler batchScheduler = 0; // batch queries: 0: OpenMP with dynamic scheduling
 	BVHInstance* blas = 0;
 	uint nodesUsed, blasCount;
 	uint* nodeIdx = 0;
@@ -26,7 +26,6 @@ struct Tri
 	float v0x, v0y, v0z, dummy0;
 	float v1x, v1y, v1z, dummy1;
 	float v2x, v2y, v2z, dummy2;
-	float cx, cy, cz, dummy3;
 };
 
 struct TriEx 
@@ -43,7 +42,7 @@ struct BVHNode
 	float minx, miny, minz;
 	int leftFirst;
 	float maxx, maxy, maxz;
-	int triCount;
+	int triCount; // interior nodes: the split axis, in bits 29 to 31
 };
 
 struct TLASNode
@@ -108,7 +107,7 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 	uint stackPtr = 0;
 	while (1)
 	{
-		if (node->triCount > 0) // isLeaf()
+		if (node->triCount & 0x1fffffff) // isLeaf()
 		{
 			for (uint i = 0; i < node->triCount; i++)
 			{
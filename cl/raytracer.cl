@@ -1,4 +1,7 @@
 #include "template/common.h"
+// the host sets these build options to match the data it uploads:
+// USE_TRIACCEL: intersect the transforms in accelData; see BVH::PrecomputeTriangles
+// USE_LEAF_ORDER: triData, accelData and triExData are in leaf order; see BVH::ReorderTriangles
 #include "cl/tools.cl"
 
 __constant float3 lightPos = (float3)(3, 10, 2);
@@ -7,8 +10,8 @@ __constant float3 ambient = (float3)(0.2f, 0.2f, 0.4f);
 
 float3 Trace( struct Ray* ray, __global float* skyPixels, 
 	__global struct BVHInstance* instData, __global struct TLASNode* tlasData,
-	__global uint* texData, __global struct Tri* triData, __global struct TriEx* triExData,
-	__global struct BVHNode* bvhNodeData, __global uint* idxData 
+	__global uint* texData, __global struct Tri* triData, __global struct TriAccel* accelData,
+	__global struct TriEx* triExData, __global struct BVHNode* bvhNodeData, __global uint* idxData 
 )
 {
 #if 1
@@ -18,7 +21,7 @@ float3 Trace( struct Ray* ray, __global float* skyPixels,
 	// bounce until we hit the sky or a diffuse surface
 	while (rayDepth < 4)
 	{
-		TLASIntersect( ray, triData, instData, tlasData, bvhNodeData, idxData );
+		TLASIntersect( ray, triData, accelData, instData, tlasData, bvhNodeData, idxData );
 		struct Intersection i = ray->hit;
 		if (i.t == 1e30f)
 		{
@@ -58,14 +61,19 @@ float3 Trace( struct Ray* ray, __global float* skyPixels,
 			float3 L = lightPos - I;
 			float dist = length( L );
 			L *= 1.0f / dist;
-			return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+			// cast a shadow ray if the surface faces the light; any hit before the light will do
+			float NdotL = max( 0.0f, dot( N, L ) );
+			struct Ray shadowRay;
+			shadowRay.O = I + L * 0.005f, shadowRay.D = L;
+			if (NdotL > 0 && TLASIsOccluded( &shadowRay, dist - 0.01f, triData, accelData, instData, tlasData, bvhNodeData, idxData )) NdotL = 0;
+			return albedo * (ambient + NdotL * lightColor * (1.0f / (dist * dist)));
 		}
 		rayDepth++;
 	}
 	return (float3)( 1, 1, 1 );
 #else
 	// minimal depth renderer for performance experiments
-	TLASIntersect( ray, triData, instData, tlasData, bvhNodeData, idxData );
+	TLASIntersect( ray, triData, accelData, instData, tlasData, bvhNodeData, idxData );
 	struct Intersection i = ray->hit;
 	if (i.t == 1e30f) return (float3)( 0, 0, 0 );
 	float d = 4.0f / i.t;
@@ -76,7 +84,8 @@ float3 Trace( struct Ray* ray, __global float* skyPixels,
 __kernel void render( 
 	write_only image2d_t target,
 	__global float* skyPixels,
-	__global struct Tri* triData, __global struct TriEx* triExData,
+	__global struct Tri* triData, __global struct TriAccel* accelData,
+	__global struct TriEx* triExData,
 	__global uint* texData, __global struct TLASNode* tlasData,
 	__global struct BVHInstance* instData,
 	__global struct BVHNode* bvhNodeData, __global uint* idxData,
@@ -102,7 +111,7 @@ __kernel void render(
 		ray.D = normalize( pixelPos - ray.O );
 		ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
 		// trace the primary ray
-		color += Trace( &ray, skyPixels, instData, tlasData, texData, triData, triExData, bvhNodeData, idxData );
+		color += Trace( &ray, skyPixels, instData, tlasData, texData, triData, accelData, triExData, bvhNodeData, idxData );
 	}
 	write_imagef( target, (int2)(x, y), (float4)( color * (1.0f / 2.0f), 1 ) );
 }
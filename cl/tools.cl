@@ -41,7 +41,6 @@ struct Tri
 	float v0x, v0y, v0z, dummy1;
 	float v1x, v1y, v1z, dummy2;
 	float v2x, v2y, v2z, dummy3;
-	float cx, cy, cz, dummy4;
 };
 
 struct TriEx
@@ -53,12 +52,19 @@ struct TriEx
 	float dummy;
 };
 
+struct TriAccel
+{
+	float Ux, Uy, Uz, du;	// u = dot( U, P ) + du
+	float Vx, Vy, Vz, dv;	// v = dot( V, P ) + dv
+	float Wx, Wy, Wz, dw;	// plane distance, in units of the normal
+};
+
 struct BVHNode
 {
 	float minx, miny, minz;
 	int leftFirst;
 	float maxx, maxy, maxz;
-	int triCount;
+	int triCount; // interior nodes: the split axis, in bits 29 to 31
 };
 
 struct TLASNode
@@ -135,6 +141,53 @@ void IntersectTri( struct Ray* ray, __global struct Tri* tri, const uint instPri
 		ray->hit.v = v, ray->hit.instPrim = instPrim;
 }
 
+void IntersectTriAccel( struct Ray* ray, __global struct TriAccel* tri, const uint instPrim )
+{
+	// precomputed triangle transform: one division and five dot products
+	float3 W = (float3)(tri->Wx, tri->Wy, tri->Wz);
+	const float t = -(dot( W, ray->O ) + tri->dw) / dot( W, ray->D );
+	if (!(t > 0.0001f && t < ray->hit.t)) return;
+	const float3 I = ray->O + t * ray->D;
+	const float u = dot( (float3)(tri->Ux, tri->Uy, tri->Uz), I ) + tri->du;
+	if (u < 0 | u > 1) return;
+	const float v = dot( (float3)(tri->Vx, tri->Vy, tri->Vz), I ) + tri->dv;
+	if (v < 0 | u + v > 1) return;
+	ray->hit.t = t, ray->hit.u = u,
+	ray->hit.v = v, ray->hit.instPrim = instPrim;
+}
+
+bool OccludesRayAccel( struct Ray* ray, __global struct TriAccel* tri )
+{
+	float3 W = (float3)(tri->Wx, tri->Wy, tri->Wz);
+	const float t = -(dot( W, ray->O ) + tri->dw) / dot( W, ray->D );
+	if (!(t > 0.0001f && t < ray->hit.t)) return false;
+	const float3 I = ray->O + t * ray->D;
+	const float u = dot( (float3)(tri->Ux, tri->Uy, tri->Uz), I ) + tri->du;
+	const float v = dot( (float3)(tri->Vx, tri->Vy, tri->Vz), I ) + tri->dv;
+	return u >= 0 && v >= 0 && u + v <= 1;
+}
+
+bool OccludesRay( struct Ray* ray, __global struct Tri* tri )
+{
+	// IntersectTri without the intersection record: any hit closer than ray->hit.t occludes
+	float3 v0 = (float3)(tri->v0x, tri->v0y, tri->v0z);
+	float3 v1 = (float3)(tri->v1x, tri->v1y, tri->v1z);
+	float3 v2 = (float3)(tri->v2x, tri->v2y, tri->v2z);
+	float3 edge1 = v1 - v0, edge2 = v2 - v0;
+	float3 h = cross( ray->D, edge2 );
+	float a = dot( edge1, h );
+	if (fabs( a ) < 0.00001f) return false; // ray parallel to triangle
+	float f = 1 / a;
+	float3 s = ray->O - v0;
+	float u = f * dot( s, h );
+	if (u < 0 | u > 1) return false;
+	const float3 q = cross( s, edge1 );
+	const float v = f * dot( ray->D, q );
+	if (v < 0 | u + v > 1) return false;
+	const float t = f * dot( edge2, q );
+	return t > 0.0001f && t < ray->hit.t;
+}
+
 float IntersectAABB( struct Ray* ray, __global struct BVHNode* node )
 {
 	float tx1 = (node->minx - ray->O.x) * ray->rD.x, tx2 = (node->maxx - ray->O.x) * ray->rD.x;
@@ -148,19 +201,27 @@ float IntersectAABB( struct Ray* ray, __global struct BVHNode* node )
 
 // BVH traversal
 
-void BVHIntersect( struct Ray* ray, uint instanceIdx,
-	__global struct Tri* tri, __global struct BVHNode* bvhNode, __global uint* triIdx )
+void BVHIntersect( struct Ray* ray, uint instanceIdx, __global struct Tri* tri,
+	__global struct TriAccel* triAccel, __global struct BVHNode* bvhNode, __global uint* triIdx )
 {
 	__global struct BVHNode* node = &bvhNode[0], * stack[32];
 	uint stackPtr = 0;
 	while (1)
 	{
-		if (node->triCount > 0) // isLeaf()
+		if (node->triCount & 0x1fffffff) // isLeaf()
 		{
 			for (uint i = 0; i < node->triCount; i++)
 			{
+			#ifdef USE_LEAF_ORDER
+				uint instPrim = (instanceIdx << 20) + node->leftFirst + i; // BVH::leafTri: no triIdx lookup
+			#else
 				uint instPrim = (instanceIdx << 20) + triIdx[node->leftFirst + i];
+			#endif
+			#ifdef USE_TRIACCEL
+				IntersectTriAccel( ray, &triAccel[instPrim & 0xfffff], instPrim );
+			#else
 				IntersectTri( ray, &tri[instPrim & 0xfffff /* 20 bits */], instPrim );
+			#endif
 			}
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
@@ -186,6 +247,42 @@ void BVHIntersect( struct Ray* ray, uint instanceIdx,
 	}
 }
 
+bool BVHIsOccluded( struct Ray* ray, __global struct Tri* tri, __global struct TriAccel* triAccel,
+	__global struct BVHNode* bvhNode, __global uint* triIdx )
+{
+	// any-hit traversal: no child ordering, and the first hit closer than ray->hit.t ends it
+	__global struct BVHNode* node = &bvhNode[0], * stack[32];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->triCount & 0x1fffffff) // isLeaf()
+		{
+			for (uint i = 0; i < node->triCount; i++)
+			{
+			#ifdef USE_LEAF_ORDER
+				uint idx = node->leftFirst + i;
+			#else
+				uint idx = triIdx[node->leftFirst + i];
+			#endif
+			#ifdef USE_TRIACCEL
+				if (OccludesRayAccel( ray, &triAccel[idx] )) return true;
+			#else
+				if (OccludesRay( ray, &tri[idx] )) return true;
+			#endif
+			}
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		__global struct BVHNode* child1 = &bvhNode[node->leftFirst];
+		__global struct BVHNode* child2 = &bvhNode[node->leftFirst + 1];
+		bool hit1 = IntersectAABB( ray, child1 ) != 1e30f;
+		bool hit2 = IntersectAABB( ray, child2 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
+	}
+}
+
 void TransformRay( struct Ray* ray, __global float16* invTransform )
 {
 	// do the transform
@@ -196,19 +293,20 @@ void TransformRay( struct Ray* ray, __global float16* invTransform )
 }
 
 void InstanceIntersect( struct Ray* ray, __global struct BVHInstance* bvhInstance,
-	int blasIdx, __global struct Tri* tri, __global struct BVHNode* bvhNode, __global uint* triIdx )
+	int blasIdx, __global struct Tri* tri, __global struct TriAccel* triAccel,
+	__global struct BVHNode* bvhNode, __global uint* triIdx )
 {
 	// backup and transform ray using instance transform
 	struct Ray backup = *ray;
 	TransformRay( ray, &bvhInstance->invTransform );
 	// traverse the BLAS
-	BVHIntersect( ray, blasIdx, tri, bvhNode, triIdx );
+	BVHIntersect( ray, blasIdx, tri, triAccel, bvhNode, triIdx );
 	// restore ray without overwriting intersection record
 	backup.hit = ray->hit;
 	*ray = backup;
 }
 
-void TLASIntersect( struct Ray* ray, __global struct Tri* tri, 
+void TLASIntersect( struct Ray* ray, __global struct Tri* tri, __global struct TriAccel* triAccel,
 	__global struct BVHInstance* bvhInstance, __global struct TLASNode* tlasNode, 
 	__global struct BVHNode* bvhNode, __global uint* triIdx )
 {
@@ -223,7 +321,7 @@ void TLASIntersect( struct Ray* ray, __global struct Tri* tri,
 		if (node->leftRight == 0) // isLeaf()
 		{
 			// current node is a leaf: intersect instance
-			InstanceIntersect( ray, &bvhInstance[node->BLAS], node->BLAS, tri, bvhNode, triIdx );
+			InstanceIntersect( ray, &bvhInstance[node->BLAS], node->BLAS, tri, triAccel, bvhNode, triIdx );
 			// pop a node from the stack; terminate if none left
 			if (stackPtr == 0) break; else node = stack[--stackPtr];
 			continue;
@@ -252,6 +350,43 @@ void TLASIntersect( struct Ray* ray, __global struct Tri* tri,
 	}
 }
 
+bool InstanceIsOccluded( struct Ray* ray, __global struct BVHInstance* bvhInstance,
+	__global struct Tri* tri, __global struct TriAccel* triAccel, __global struct BVHNode* bvhNode,
+	__global uint* triIdx )
+{
+	// transform a copy of the ray; t is preserved, so hit.t still bounds the query
+	struct Ray localRay = *ray;
+	TransformRay( &localRay, &bvhInstance->invTransform );
+	return BVHIsOccluded( &localRay, tri, triAccel, bvhNode, triIdx );
+}
+
+bool TLASIsOccluded( struct Ray* ray, float tmax, __global struct Tri* tri, __global struct TriAccel* triAccel,
+	__global struct BVHInstance* bvhInstance, __global struct TLASNode* tlasNode,
+	__global struct BVHNode* bvhNode, __global uint* triIdx )
+{
+	// shadow ray query: true if anything is hit closer than tmax
+	ray->rD = (float3)(1.0f / ray->D.x, 1.0f / ray->D.y, 1.0f / ray->D.z);
+	ray->hit.t = tmax;
+	__global struct TLASNode* node = &tlasNode[0], * stack[32];
+	uint stackPtr = 0;
+	while (1)
+	{
+		if (node->leftRight == 0) // isLeaf()
+		{
+			if (InstanceIsOccluded( ray, &bvhInstance[node->BLAS], tri, triAccel, bvhNode, triIdx )) return true;
+			if (stackPtr == 0) return false; else node = stack[--stackPtr];
+			continue;
+		}
+		__global struct TLASNode* child1 = &tlasNode[node->leftRight & 0xffff];
+		__global struct TLASNode* child2 = &tlasNode[node->leftRight >> 16];
+		bool hit1 = IntersectAABB( ray, child1 ) != 1e30f;
+		bool hit2 = IntersectAABB( ray, child2 ) != 1e30f;
+		if (hit1) { node = child1; if (hit2) stack[stackPtr++] = child2; }
+		else if (hit2) node = child2;
+		else if (stackPtr == 0) return false; else node = stack[--stackPtr];
+	}
+}
+
 // skydome
 
 float3 SampleSky( float3* D, __global float* skyPixels )
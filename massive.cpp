@@ -2,6 +2,8 @@
 #include "bvh.h"
 #include "massive.h"
 
+// #define LAYOUT_BENCHMARK // compare the node orders in a simulated cache at startup
+
 // THIS SOURCE FILE:
 // Code for the article "How to Build a BVH", part 10: Massive.
 // This version shows how to render a scene with massive instancing
@@ -86,6 +88,33 @@ void MassiveApp::HandleKeys()
 void MassiveApp::Init()
 {
 	mesh = new Mesh( "assets/dragon.obj", "assets/bricks.png" );
+	// the dragon BLAS is shared by all instances; spend some time on its quality
+	mesh->bvh->OptimizeTreelets( 2 );
+	mesh->bvh->ReorderTriangles(); // the GPU traversal expects triangles in leaf order
+	mesh->bvh->PrecomputeTriangles(); // the GPU intersects the per-triangle transforms
+#ifdef LAYOUT_BENCHMARK
+	// compare node orders in a simulated 32KB cache, using rays into the dragon
+	const int probeCount = 65536;
+	Ray* probe = new Ray[probeCount];
+	const BVHNode& root = mesh->bvh->bvhNode[0];
+	const float3 center = (root.aabbMin + root.aabbMax) * 0.5f, extent = root.aabbMax - root.aabbMin;
+	for (int i = 0; i < probeCount; i++)
+	{
+		float3 target = center + (float3( RandomFloat(), RandomFloat(), RandomFloat() ) - 0.5f) * extent;
+		probe[i].O = center + normalize( float3( RandomFloat(), RandomFloat(), RandomFloat() ) - 0.5f ) * length( extent );
+		probe[i].D = normalize( target - probe[i].O );
+	}
+	const char* layoutName[3] = { "depth-first", "breadth-first top", "van Emde Boas" };
+	for (int i = 0; i < 3; i++)
+	{
+		mesh->bvh->Relayout( (NodeLayout)i );
+		printf( "%s node order: %.2f node cache misses per ray.\n", layoutName[i], mesh->bvh->CacheMisses( probe, probeCount ) );
+	}
+	delete[] probe;
+#endif
+	// breadth-first top levels: marginally fewer misses than the others for the dragon
+	mesh->bvh->Relayout( LAYOUT_BFS_TOP );
+	printf( "compacting the BLAS saved %.1fKB.\n", mesh->bvh->Compact() / 1024.0f );
 	// load HDR sky
 	skyPixels = stbi_loadf( "assets/sky_19.hdr", &skyWidth, &skyHeight, &skyBpp, 0 );
 	for (int i = 0; i < skyWidth * skyHeight * 3; i++) skyPixels[i] = sqrtf( skyPixels[i] );
@@ -106,21 +135,25 @@ void MassiveApp::Init()
 	tlas.Build();
 	printf( "building TLAS took %.2fms.\n", t.elapsed() * 1000 );
 	// prepare OpenCL
-	tracer = new Kernel( "cl/raytracer.cl", "render" );
+	tracer = new Kernel( "cl/raytracer.cl", "render", "-D USE_TRIACCEL -D USE_LEAF_ORDER" ); // matches the uploaded data
 	target = new Buffer( GetRenderTarget()->ID, 0, Buffer::TARGET );
 	screen = 0;
 	// target = new Buffer( SCRWIDTH * SCRHEIGHT * 4 ); // intermediate screen buffer / render target
 	skyData = new Buffer( skyWidth * skyHeight * 3 * sizeof( float ), skyPixels );
 	skyData->CopyToDevice();
-	triData = new Buffer( mesh->triCount * sizeof( Tri ), mesh->tri );
-	triExData = new Buffer( mesh->triCount * sizeof( TriEx ), mesh->triEx );
+	// leaf order: the triangles, transforms and shading data follow the leaves; see BVH::ReorderTriangles
+	const uint leafTris = mesh->bvh->idxCount;
+	triData = new Buffer( leafTris * sizeof( Tri ), mesh->bvh->leafTri );
+	accelData = new Buffer( leafTris * sizeof( TriAccel ), mesh->bvh->triAccel );
+	triExData = new Buffer( leafTris * sizeof( TriEx ), mesh->bvh->leafTriEx );
 	Surface* tex = mesh->texture;
 	texData = new Buffer( tex->width * tex->height * sizeof( uint ), tex->pixels );
 	instData = new Buffer( 11042 * sizeof( BVHInstance ), bvhInstance );
 	tlasData = new Buffer( 11042 * 2 * sizeof( TLASNode ), tlas.tlasNode );
 	bvhData = new Buffer( mesh->bvh->nodesUsed * sizeof( BVHNode ), mesh->bvh->bvhNode );
-	idxData = new Buffer( mesh->triCount * sizeof( uint ), mesh->bvh->triIdx );
+	idxData = new Buffer( leafTris * sizeof( uint ), mesh->bvh->triIdx );
 	triData->CopyToDevice();
+	accelData->CopyToDevice();
 	triExData->CopyToDevice();
 	texData->CopyToDevice();
 	instData->CopyToDevice();
@@ -151,7 +184,7 @@ void MassiveApp::Tick( float deltaTime )
 	// render the scene using the GPU
 	tracer->SetArguments( 
 		target, skyData, 
-		triData, triExData, texData, tlasData, instData, bvhData, idxData, 
+		triData, accelData, triExData, texData, tlasData, instData, bvhData, idxData, 
 		camPos, p0, p1, p2 
 	);
 	tracer->Run( SCRWIDTH * SCRHEIGHT );
@@ -17,9 +17,11 @@ TheApp* CreateApp() { return new PrettyApp(); }
 void PrettyApp::Init()
 {
 	Mesh* mesh = new Mesh( "assets/teapot.obj", "assets/bricks.png" );
+	mesh->bvh->SetWidth( 8 ); // wide traversal for the reflected and refracted rays; 4-wide without AVX2
 	for (int i = 0; i < 16; i++)
 		bvhInstance[i] = BVHInstance( mesh->bvh, i );
 	tlas = TLAS( bvhInstance, 16 );
+	tlas.SetWidth( 4 ); // applied by BuildQuick
 	// setup screen plane in world space
 	float aspectRatio = (float)SCRWIDTH / SCRHEIGHT;
 	p0 = TransformPosition( float3( -aspectRatio, 1, 2 ), mat4::RotateX( 0.5f ) );
@@ -49,6 +51,11 @@ void PrettyApp::AnimateScene()
 float3 PrettyApp::Trace( Ray& ray )
 {
 	tlas.Intersect( ray );
+	return Shade( ray );
+}
+
+float3 PrettyApp::Shade( const Ray& ray )
+{
 	Intersection i = ray.hit;
 	if (i.t == 1e30f) return float3( 0 );
 	return float3( i.u, i.v, 1 - (i.u + i.v) );
@@ -62,20 +69,29 @@ void PrettyApp::Tick( float deltaTime )
 #pragma omp parallel for schedule(dynamic)
 	for (int tile = 0; tile < (SCRWIDTH * SCRHEIGHT / 64); tile++)
 	{
-		// render an 8x8 tile
+		// render an 8x8 tile as four packets of 4x4 coherent camera rays
 		int x = tile % (SCRWIDTH / 8), y = tile / (SCRWIDTH / 8);
-		Ray ray;
-		ray.O = float3( 0, 3, -6.5f );
-		for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++)
+		const float3 O( 0, 3, -6.5f );
+		RayPacket16 packet;
+		for (int p = 0; p < 4; p++)
 		{
-			// setup a primary ray
-			float3 pixelPos = ray.O + p0 +
-				(p1 - p0) * ((x * 8 + u) / (float)SCRWIDTH) +
-				(p2 - p0) * ((y * 8 + v) / (float)SCRHEIGHT);
-			ray.D = normalize( pixelPos - ray.O );
-			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-			uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
-			accumulator[pixelAddress] = Trace( ray );
+			const int px = x * 8 + (p & 1) * 4, py = y * 8 + (p >> 1) * 4;
+			for (int i = 0; i < 16; i++)
+			{
+				// setup a primary ray
+				float3 pixelPos = O + p0 +
+					(p1 - p0) * ((px + (i & 3)) / (float)SCRWIDTH) +
+					(p2 - p0) * ((py + (i >> 2)) / (float)SCRHEIGHT);
+				packet.Set( i, O, normalize( pixelPos - O ) );
+			}
+			tlas.Intersect( packet );
+			for (int i = 0; i < 16; i++)
+			{
+				Ray ray;
+				packet.Get( i, ray );
+				uint pixelAddress = px + (i & 3) + (py + (i >> 2)) * SCRWIDTH;
+				accumulator[pixelAddress] = Shade( ray );
+			}
 		}
 	}
 	// convert the floating point accumulator into pixels
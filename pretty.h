@@ -11,6 +11,7 @@ public:
 	void Init();
 	void AnimateScene();
 	float3 Trace( Ray& ray );
+	float3 Shade( const Ray& ray );
 	void Tick( float deltaTime );
 	void Shutdown() { /* implement if you want to do something on exit */ }
 	// input handling
@@ -1168,7 +1168,7 @@ class Kernel
 	friend class Buffer;
 public:
 	// constructor / destructor
-	Kernel( char* file, char* entryPoint );
+	Kernel( char* file, char* entryPoint, const char* options = 0 ); // options: added to the build options, e.g. "-D NAME"
 	Kernel( cl_program& existingProgram, char* entryPoint );
 	~Kernel();
 	// get / set
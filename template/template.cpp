@@ -1130,7 +1130,7 @@ void Buffer::Clear()
 
 // Kernel constructor
 // ----------------------------------------------------------------------------
-Kernel::Kernel( char* file, char* entryPoint )
+Kernel::Kernel( char* file, char* entryPoint, const char* options )
 {
 	if (!clStarted) InitCL();
 	// load a cl file
@@ -1194,11 +1194,12 @@ Kernel::Kernel( char* file, char* entryPoint )
 	// -cl-no-subgroup-ifp ? fails on nvidia.
 #if 1
 	// AMD compatible compilation, thanks Jasper the Winther
-	error = clBuildProgram( program, 0, NULL, "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
-
+	string buildOptions = "-cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #else
-	error = clBuildProgram( program, 0, NULL, "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant", NULL, NULL );
+	string buildOptions = "-cl-nv-verbose -cl-fast-relaxed-math -cl-mad-enable -cl-single-precision-constant";
 #endif
+	if (options) buildOptions += string( " " ) + options;
+	error = clBuildProgram( program, 0, NULL, buildOptions.c_str(), NULL, NULL );
 	// handle errors
 	if (error == CL_SUCCESS)
 	{
@@ -27,9 +27,13 @@ inline float3 RGB8toRGB32F( uint c )
 void WhittedApp::Init()
 {
 	mesh = new Mesh( "assets/teapot.obj", "assets/bricks.png" );
+	mesh->bvh->SetLeafBlocks( 4 ); // SoA leaves of four triangles, tested with a single SSE pass
+	mesh->bvh->Build();
+	mesh->bvh->SetWidth( 8 ); // wide traversal for the reflected and refracted rays; 4-wide without AVX2
 	for (int i = 0; i < 16; i++)
 		bvhInstance[i] = BVHInstance( mesh->bvh, i );
 	tlas = TLAS( bvhInstance, 16 );
+	tlas.SetWidth( 4 ); // applied by BuildQuick
 	// create a floating point accumulator for the screen
 	accumulator = new float3[SCRWIDTH * SCRHEIGHT];
 	// load HDR sky
@@ -58,6 +62,11 @@ void WhittedApp::AnimateScene()
 float3 WhittedApp::Trace( Ray& ray, int rayDepth )
 {
 	tlas.Intersect( ray );
+	return Shade( ray, rayDepth );
+}
+
+float3 WhittedApp::Shade( Ray& ray, int rayDepth )
+{
 	Intersection i = ray.hit;
 	if (i.t == 1e30f)
 	{
@@ -102,7 +111,12 @@ float3 WhittedApp::Trace( Ray& ray, int rayDepth )
 		float3 L = lightPos - I;
 		float dist = length( L );
 		L *= 1.0f / dist;
-		return albedo * (ambient + max( 0.0f, dot( N, L ) ) * lightColor * (1.0f / (dist * dist)));
+		// cast a shadow ray if the surface faces the light; any hit before the light will do
+		float NdotL = max( 0.0f, dot( N, L ) );
+		Ray shadowRay;
+		shadowRay.O = I + L * 0.001f, shadowRay.D = L;
+		if (NdotL > 0 && tlas.IsOccluded( shadowRay, dist - 0.002f )) NdotL = 0;
+		return albedo * (ambient + NdotL * lightColor * (1.0f / (dist * dist)));
 	}
 }
 
@@ -122,20 +136,28 @@ void WhittedApp::Tick( float deltaTime )
 #pragma omp parallel for schedule(dynamic)
 	for (int tile = 0; tile < (SCRWIDTH * SCRHEIGHT / 64); tile++)
 	{
-		// render an 8x8 tile
+		// render an 8x8 tile as four packets of 4x4 coherent camera rays
 		int x = tile % (SCRWIDTH / 8), y = tile / (SCRWIDTH / 8);
-		Ray ray;
-		ray.O = camPos;
-		for (int v = 0; v < 8; v++) for (int u = 0; u < 8; u++)
+		RayPacket16 packet;
+		for (int p = 0; p < 4; p++)
 		{
-			// setup a primary ray
-			float3 pixelPos = ray.O + p0 +
-				(p1 - p0) * ((x * 8 + u + RandomFloat()) / SCRWIDTH) +
-				(p2 - p0) * ((y * 8 + v + RandomFloat()) / SCRHEIGHT);
-			ray.D = normalize( pixelPos - ray.O );
-			ray.hit.t = 1e30f; // 1e30f denotes 'no hit'
-			uint pixelAddress = x * 8 + u + (y * 8 + v) * SCRWIDTH;
-			accumulator[pixelAddress] = Trace( ray );
+			const int px = x * 8 + (p & 1) * 4, py = y * 8 + (p >> 1) * 4;
+			for (int i = 0; i < 16; i++)
+			{
+				// setup a primary ray
+				float3 pixelPos = camPos + p0 +
+					(p1 - p0) * ((px + (i & 3) + RandomFloat()) / SCRWIDTH) +
+					(p2 - p0) * ((py + (i >> 2) + RandomFloat()) / SCRHEIGHT);
+				packet.Set( i, camPos, normalize( pixelPos - camPos ) );
+			}
+			tlas.Intersect( packet );
+			for (int i = 0; i < 16; i++)
+			{
+				Ray ray;
+				packet.Get( i, ray );
+				uint pixelAddress = px + (i & 3) + (py + (i >> 2)) * SCRWIDTH;
+				accumulator[pixelAddress] = Shade( ray );
+			}
 		}
 	}
 	// convert the floating point accumulator into pixels
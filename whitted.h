@@ -11,6 +11,7 @@ public:
 	void Init();
 	void AnimateScene();
 	float3 Trace( Ray& ray, int rayDepth = 0 );
+	float3 Shade( Ray& ray, int rayDepth = 0 );
 	void Tick( float deltaTime );
 	void Shutdown() { /* implement if you want to do something on exit */ }
 	// input handling